@@ -1,4 +1,5 @@
 import src.bin2c as bin2c
+import src.run2c as run2c
 import re
 import os
 Import("env")  # type: ignore
@@ -25,3 +26,26 @@ make_include_h('chart-v3.9.1.min.js', gzip=True)
 make_include_h('FileSaver-v2.0.5.min.js', gzip=True)
 make_include_h('index.html', gzip=True)
 make_include_h('nyancat.bmp', uint16=True)
+
+
+def make_replay_h(input, run_index):
+    output_file = 'src/replay_run.h'
+    if not os.path.isfile(input):
+        print('Replay file "%s" is not found!' % input)
+        env.Exit(1)  # type: ignore
+    print('converting run %d of %s to %s' % (run_index, input, output_file))
+    header = run2c.run2c(input, run_index)
+    # only write if it changed, so it doesn't cause a rebuild every time
+    if os.path.exists(output_file):
+        with open(output_file) as f:
+            if f.read() == header:
+                return
+    with open(output_file, mode='w') as f:
+        f.write(header)
+
+
+# Only the replay environment sets this, see platformio.ini
+replay_file = env.GetProjectOption('custom_replay_file', '')  # type: ignore
+if replay_file:
+    make_replay_h(replay_file,
+                  int(env.GetProjectOption('custom_replay_run', '0')))  # type: ignore
@@ -1,4 +1,4 @@
-use std::sync::Arc;
+use std::sync::{Arc, Mutex};
 
 use num_derive::FromPrimitive;
 use rocket::{
@@ -6,9 +6,12 @@ use rocket::{
     get,
     response::stream::{Event, EventStream},
     routes,
-    serde::Serialize,
+    serde::{json::serde_json, Deserialize, Serialize},
     tokio::{
-        self, select,
+        self,
+        io::{AsyncBufReadExt, AsyncWriteExt, BufReader},
+        net::TcpStream,
+        select,
         sync::{
             broadcast::{channel, error::RecvError, Sender},
             RwLock,
@@ -18,6 +21,53 @@ use rocket::{
     FromFormField, Shutdown, State,
 };
 
+/// Knobs for load testing the web interface. These are read from
+/// `Rocket.toml` or from `ROCKET_`-prefixed environment variables, so for
+/// example `ROCKET_SAMPLE_RATE=500 ROCKET_SLOW_CONSUMERS=10 cargo run`.
+#[derive(Deserialize)]
+#[serde(crate = "rocket::serde", default)]
+struct MockConfig {
+    /// Telemetry samples per second while running.
+    sample_rate: u32,
+    /// Capacity of the broadcast channel. Subscribers that fall further
+    /// behind than this lose events, which are counted as drops.
+    queue_capacity: usize,
+    /// Saved browser JSON (from the Save... button) to replay instead of the
+    /// simulated flight.
+    replay_file: Option<String>,
+    /// Which run in `replay_file` to replay.
+    replay_run: usize,
+    /// Playback speed of the replay. 1.0 is the original timing, 0.0 sends
+    /// the whole run in one burst.
+    replay_speed: f64,
+    /// Number of simulated spectators that connect to `/events` and read the
+    /// stream slowly.
+    slow_consumers: u32,
+    /// How long each simulated spectator waits after reading one event,
+    /// before it reads from its socket again.
+    slow_consumer_delay_ms: u64,
+    /// Seconds between latency and drop reports. 0 disables reporting.
+    report_interval: u64,
+    /// Print every generated sample to stdout.
+    log_samples: bool,
+}
+
+impl Default for MockConfig {
+    fn default() -> Self {
+        MockConfig {
+            sample_rate: 10,
+            queue_capacity: 100,
+            replay_file: None,
+            replay_run: 0,
+            replay_speed: 1.0,
+            slow_consumers: 0,
+            slow_consumer_delay_ms: 50,
+            report_interval: 0,
+            log_samples: true,
+        }
+    }
+}
+
 #[derive(Clone, Copy, FromFormField, FromPrimitive)]
 enum AccelRange {
     #[field(value = "2")]
@@ -78,6 +128,101 @@ impl Default for FilterBandwidthHz {
     }
 }
 
+/// An event as it travels through the broadcast channel, stamped with the
+/// time it was generated so that subscribers can measure latency.
+#[derive(Clone)]
+struct QueuedEvent {
+    event: Event,
+    sent_at: Instant,
+}
+
+// Same log-linear histogram as the firmware: exact below 16 us, and within an
+// eighth above that. Fixed size, so it doesn't grow however long we run
+// without reporting.
+const LATENCY_SUB_BUCKET_BITS: u32 = 3;
+const LATENCY_BUCKETS: usize = ((65 - LATENCY_SUB_BUCKET_BITS) << LATENCY_SUB_BUCKET_BITS) as usize;
+
+fn latency_bucket(us: u64) -> usize {
+    if us < (2 << LATENCY_SUB_BUCKET_BITS) {
+        return us as usize;
+    }
+    let top_bit = 63 - us.leading_zeros();
+    let shift = top_bit - LATENCY_SUB_BUCKET_BITS;
+    let sub_bucket = (us >> shift) & ((1 << LATENCY_SUB_BUCKET_BITS) - 1);
+    ((u64::from(shift + 1) << LATENCY_SUB_BUCKET_BITS) + sub_bucket) as usize
+}
+
+/// The lowest latency that ends up in a bucket
+fn latency_bucket_start(bucket: usize) -> u64 {
+    if bucket < (2 << LATENCY_SUB_BUCKET_BITS) {
+        return bucket as u64;
+    }
+    let shift = (bucket >> LATENCY_SUB_BUCKET_BITS) - 1;
+    let sub_bucket = (bucket & ((1 << LATENCY_SUB_BUCKET_BITS) - 1)) as u64;
+    ((1 << LATENCY_SUB_BUCKET_BITS) + sub_bucket) << shift
+}
+
+struct ConsumerStats {
+    delivered: u64,
+    dropped: u64,
+    latency_buckets: Vec<u64>,
+    latency_max_us: u64,
+}
+
+impl Default for ConsumerStats {
+    fn default() -> Self {
+        ConsumerStats {
+            delivered: 0,
+            dropped: 0,
+            latency_buckets: vec![0; LATENCY_BUCKETS],
+            latency_max_us: 0,
+        }
+    }
+}
+
+impl ConsumerStats {
+    fn record(&mut self, sent_at: Instant) {
+        self.delivered += 1;
+        let latency_us = sent_at.elapsed().as_micros() as u64;
+        self.latency_buckets[latency_bucket(latency_us)] += 1;
+        self.latency_max_us = self.latency_max_us.max(latency_us);
+    }
+
+    fn report(&mut self, label: &str) {
+        let percentile = |p: f64| -> u64 {
+            let wanted = (self.delivered as f64 * p).ceil() as u64;
+            let mut seen = 0;
+            for (bucket, count) in self.latency_buckets.iter().enumerate() {
+                seen += count;
+                if seen >= wanted && seen > 0 {
+                    return latency_bucket_start(bucket);
+                }
+            }
+            0
+        };
+        println!(
+            "  {label}: delivered {} dropped {} latency us p50 {} p95 {} p99 {} max {}",
+            self.delivered,
+            self.dropped,
+            percentile(0.5),
+            percentile(0.95),
+            percentile(0.99),
+            self.latency_max_us,
+        );
+        *self = ConsumerStats::default();
+    }
+}
+
+/// Counters for the load test report. Reset every time a report is printed.
+#[derive(Default)]
+struct LoadStats {
+    generated: u64,
+    clients: ConsumerStats,
+    simulated: ConsumerStats,
+}
+
+type SharedStats = Arc<Mutex<LoadStats>>;
+
 struct ServerState {
     telemetry_running: bool,
     telemetry_requested: bool,
@@ -87,16 +232,21 @@ struct ServerState {
     accel_range: AccelRange,
     gyro_range: GyroRange,
     filter_bandwidth: FilterBandwidthHz,
-    queue: Sender<Event>,
+    queue: Sender<QueuedEvent>,
     event_id: u64,
+    stats: SharedStats,
 }
 
 impl ServerState {
     fn send_event(&mut self, event: Event) {
         self.event_id += 1;
         let id = format!("{}", self.event_id);
+        self.stats.lock().unwrap().generated += 1;
         // We don't care if there are no subscribers
-        _ = self.queue.send(event.id(id));
+        _ = self.queue.send(QueuedEvent {
+            event: event.id(id),
+            sent_at: Instant::now(),
+        });
     }
 }
 
@@ -111,7 +261,7 @@ struct Parameters {
     filter_bandwidth: u32,
 }
 
-#[derive(Clone, Debug, Serialize)]
+#[derive(Clone, Debug, Deserialize, Serialize)]
 #[serde(crate = "rocket::serde")]
 struct Telemetry {
     time: u64,
@@ -129,6 +279,27 @@ struct Telemetry {
     mpu_temperature: f32,
 }
 
+/// One run as saved by the web interface. We only care about the samples.
+#[derive(Deserialize)]
+#[serde(crate = "rocket::serde")]
+struct RecordedRun {
+    data: Vec<Telemetry>,
+}
+
+fn load_replay(path: &str, run: usize) -> Vec<Telemetry> {
+    let contents = std::fs::read_to_string(path)
+        .unwrap_or_else(|e| panic!("Could not read replay file {path}: {e}"));
+    let runs: Vec<RecordedRun> = serde_json::from_str(&contents)
+        .unwrap_or_else(|e| panic!("Could not parse replay file {path}: {e}"));
+    let samples = runs
+        .into_iter()
+        .nth(run)
+        .unwrap_or_else(|| panic!("Replay file {path} has no run with index {run}"))
+        .data;
+    println!("Loaded {} samples from run {run} of {path}", samples.len());
+    samples
+}
+
 #[get("/")]
 async fn index() -> Option<NamedFile> {
     NamedFile::open("../src/index.html").await.ok()
@@ -215,23 +386,117 @@ async fn parameters(
     "".to_string()
 }
 
-#[get("/events")]
+/// `simulated` is only set by `slow_consumer()`, so its numbers get reported
+/// separately from the real clients.
+#[get("/events?<simulated>")]
 async fn events(
+    simulated: Option<bool>,
     server_state: &State<Arc<RwLock<ServerState>>>,
     mut shutdown: Shutdown,
 ) -> EventStream![] {
-    let mut rx = server_state.read().await.queue.subscribe();
+    let simulated = simulated.unwrap_or(false);
+    let server_state = server_state.read().await;
+    let mut rx = server_state.queue.subscribe();
+    let stats = server_state.stats.clone();
     EventStream! {
         loop {
-            let event = select! {
-                event = rx.recv() => match event {
-                    Ok(event) => event,
+            let queued = select! {
+                queued = rx.recv() => match queued {
+                    Ok(queued) => queued,
                     Err(RecvError::Closed) => break,
-                    Err(RecvError::Lagged(_)) => continue,
+                    Err(RecvError::Lagged(missed)) => {
+                        let mut stats = stats.lock().unwrap();
+                        if simulated {
+                            stats.simulated.dropped += missed;
+                        } else {
+                            stats.clients.dropped += missed;
+                        }
+                        continue;
+                    }
                 },
                 _ = &mut shutdown => break,
             };
-            yield event;
+            // The stream only gets polled when the connection can take more
+            // data, so this includes the time spent waiting on the socket.
+            {
+                let mut stats = stats.lock().unwrap();
+                if simulated {
+                    stats.simulated.record(queued.sent_at);
+                } else {
+                    stats.clients.record(queued.sent_at);
+                }
+            }
+            yield queued.event;
+        }
+    }
+}
+
+/// Emulates a spectator on a bad connection. It connects to `/events` like a
+/// browser would, and waits `delay` after every event it reads. Once the
+/// socket buffers fill up, the server can only send as fast as that, so it's
+/// the real HTTP and SSE stack that has to deal with the backpressure.
+async fn slow_consumer(address: String, delay: Duration, mut shutdown: Shutdown) {
+    // The server might not be listening quite yet
+    let stream = loop {
+        match TcpStream::connect(&address).await {
+            Ok(stream) => break stream,
+            Err(_) => time::sleep(Duration::from_millis(100)).await,
+        }
+    };
+    // HTTP/1.0, so the body isn't chunked and every line is part of an event
+    let (reader, mut writer) = stream.into_split();
+    let request = "GET /events?simulated=true HTTP/1.0\r\nAccept: text/event-stream\r\n\r\n";
+    if writer.write_all(request.as_bytes()).await.is_err() {
+        return;
+    }
+    let mut reader = BufReader::new(reader);
+    let reading = async {
+        let mut line = String::new();
+        let mut in_event = false;
+        loop {
+            line.clear();
+            match reader.read_line(&mut line).await {
+                Ok(0) | Err(_) => break,
+                Ok(_) => {}
+            }
+            // A blank line ends an event, or the response headers
+            if line.trim_end().is_empty() {
+                if in_event {
+                    time::sleep(delay).await;
+                }
+                in_event = false;
+            } else if !line.starts_with(':') {
+                in_event = true;
+            }
+        }
+    };
+    select! {
+        _ = reading => {},
+        _ = &mut shutdown => {},
+    }
+}
+
+async fn stats_reporter(stats: SharedStats, interval: Duration, mut shutdown: Shutdown) {
+    let mut ticker = time::interval(interval);
+    // The first tick completes immediately
+    ticker.tick().await;
+    let mut last_report = Instant::now();
+    loop {
+        select! {
+            _ = ticker.tick() => {
+                let elapsed = last_report.elapsed().as_secs_f64();
+                last_report = Instant::now();
+                let mut stats = stats.lock().unwrap();
+                println!(
+                    "Generated {} events ({:.1}/s)",
+                    stats.generated,
+                    stats.generated as f64 / elapsed
+                );
+                stats.generated = 0;
+                stats.clients.report("clients");
+                stats.simulated.report("simulated");
+            },
+            _ = &mut shutdown => break,
         }
     }
 }
@@ -239,18 +504,18 @@ async fn _jitter_around(value: &mut f32, plusminus: f32, center: f32) {
     *value = center + rand::random::<f32>() * plusminus 
 }
 
-async fn futz_with_telemetry(telemetry: &mut Telemetry, iterations: u64) {
-    // Every iteration is 100ms. For the first second, just add a little jitter.
+async fn futz_with_telemetry(telemetry: &mut Telemetry, time: u64, step: f32, log: bool) {
+    // Every iteration is `step` seconds, `time` is in ms since the start.
+    // For the first second, just add a little jitter.
     // Then for one second, start with 4G acceleration and slowly decrease to -1G.
     // Update barometric pressure and height accordingly.
     // Then do nothing for 2 seconds.
     // Then simulate crashing into the ground.
-    let time = iterations * 100; // Crude, but fine.
-                                 // Set height (and barometric pressure) according to speed and acceleration.
-                                 // Only if speed and altitude are not zero (or time is below 2000ms).
+    // Set height (and barometric pressure) according to speed and acceleration.
+    // Only if speed and altitude are not zero (or time is below 2000ms).
     if (telemetry.speed_z != 0.0 && telemetry.altitude != 0.0) || (time < 2000) {
-        telemetry.altitude += telemetry.speed_z * 0.1;
-        telemetry.speed_z += telemetry.acceleration_z * 0.1;
+        telemetry.altitude += telemetry.speed_z * step;
+        telemetry.speed_z += telemetry.acceleration_z * step;
         if telemetry.altitude <= 0.0 && telemetry.speed_z <= 0.0 {
             telemetry.altitude = 0.0;
             telemetry.speed_z = 0.0;
@@ -266,15 +531,23 @@ async fn futz_with_telemetry(telemetry: &mut Telemetry, iterations: u64) {
     }
     // Add a little jitter to the Z axis
     telemetry.acceleration_z += (rand::random::<f32>() - 0.5) * 0.5;
-    println!("{telemetry:?}");
+    if log {
+        println!("{telemetry:?}");
+    }
 }
 
-async fn generator_loop(server_state: Arc<RwLock<ServerState>>, mut shutdown: Shutdown) {
-    let sleep = time::sleep(time::Duration::from_millis(100));
-    tokio::pin!(sleep);
+async fn generator_loop(
+    server_state: Arc<RwLock<ServerState>>,
+    config: Arc<MockConfig>,
+    replay: Option<Vec<Telemetry>>,
+    mut shutdown: Shutdown,
+) {
+    let sample_rate = config.sample_rate.max(1);
+    let mut ticker = time::interval(Duration::from_secs(1) / sample_rate);
     let mut counter: u64 = 0;
     let mut start: u64 = 0;
-    let tx = server_state.read().await.queue.clone();
+    let mut replay_position: usize = 0;
+    let mut replay_started = Instant::now();
 
     // Pressure at sea level is 1013.25 hPa. Set variable in Pascal.
     const START_TELEMETRY: Telemetry = Telemetry {
@@ -295,46 +568,72 @@ async fn generator_loop(server_state: Arc<RwLock<ServerState>>, mut shutdown: Sh
 
     loop {
         select! {
-            () = &mut sleep => {
+            _ = ticker.tick() => {
                 let mut events = Vec::new();
-                {
-                    let mut server_state = server_state.write().await;
-                    counter += 1;
-                    if server_state.telemetry_requested {
-                        if !server_state.telemetry_running {
-                            server_state.telemetry_running = true;
-                            telemetry = START_TELEMETRY;
-                            start = counter;
-                            events.push(Event::empty().event("telemetry_started"));
-                        }
-                        futz_with_telemetry(&mut telemetry, counter - start).await;
-                        events.push(Event::json(&telemetry).event("telemetry"));
-                    } else {
-                        if server_state.telemetry_running {
-                            server_state.telemetry_running = false;
-                            events.push(Event::empty().event("telemetry_stopped"));
+                let mut server_state = server_state.write().await;
+                counter += 1;
+                if server_state.telemetry_requested {
+                    if !server_state.telemetry_running {
+                        server_state.telemetry_running = true;
+                        telemetry = START_TELEMETRY;
+                        start = counter;
+                        replay_position = 0;
+                        replay_started = Instant::now();
+                        events.push(Event::empty().event("telemetry_started"));
+                    }
+                    if let Some(replay) = &replay {
+                        // Send every recorded sample that is due by now
+                        let due = if config.replay_speed > 0.0 {
+                            replay_started.elapsed().as_secs_f64() * 1000.0 * config.replay_speed
+                        } else {
+                            f64::INFINITY
+                        };
+                        while replay_position < replay.len()
+                            && (replay[replay_position].time - replay[0].time) as f64 <= due
+                        {
+                            events.push(Event::json(&replay[replay_position]).event("telemetry"));
+                            replay_position += 1;
                         }
-                        if counter % 10 == 0 {
-                            events.push(Event::empty().event("idle"));
+                        if replay_position == replay.len() {
+                            // End of the recording, stop like the real thing would
+                            server_state.telemetry_requested = false;
                         }
+                    } else {
+                        let time = (counter - start) * 1000 / u64::from(sample_rate);
+                        let step = 1.0 / sample_rate as f32;
+                        futz_with_telemetry(&mut telemetry, time, step, config.log_samples).await;
+                        events.push(Event::json(&telemetry).event("telemetry"));
                     }
-                    for mut event in events {
-                        event = event.id(format!("{}", server_state.event_id));
-                        server_state.event_id += 1;
-                        // If there are no receivers, that's fine.
-                        let _ = tx.send(event);
-                    }
+                } else if server_state.telemetry_running {
+                    // Like the firmware, no idle events. The EventStream
+                    // heartbeat keeps the connection alive.
+                    server_state.telemetry_running = false;
+                    events.push(Event::empty().event("telemetry_stopped"));
+                }
+                for event in events {
+                    server_state.send_event(event);
                 }
-                sleep.as_mut().reset(Instant::now() + Duration::from_millis(100));
             },
-            () = &mut shutdown => break,
+            _ = &mut shutdown => break,
         }
     }
 }
 
 #[rocket::main]
 async fn main() -> Result<(), rocket::Error> {
-    let (tx, _) = channel(100);
+    let rocket = rocket::build();
+    let config: MockConfig = rocket
+        .figment()
+        .extract()
+        .expect("Invalid mock configuration");
+    let config = Arc::new(config);
+    let replay = config
+        .replay_file
+        .as_deref()
+        .map(|path| load_replay(path, config.replay_run));
+
+    let stats = SharedStats::default();
+    let (tx, _) = channel(config.queue_capacity.max(1));
     let server_state = Arc::new(RwLock::new(ServerState {
         telemetry_running: false,
         telemetry_requested: false,
@@ -346,10 +645,15 @@ async fn main() -> Result<(), rocket::Error> {
         filter_bandwidth: FilterBandwidthHz::default(),
         queue: tx,
         event_id: 0,
+        stats: stats.clone(),
     }));
 
     let state_for_generator = server_state.clone();
-    let rocket = rocket::build()
+    let address = rocket
+        .figment()
+        .extract_inner::<std::net::IpAddr>("address");
+    let port: u16 = rocket.figment().extract_inner("port").unwrap_or(8000);
+    let rocket = rocket
         .mount(
             "/",
             routes![index, chart, chartjs, favicon, filesaver, events, start, stop, parameters],
@@ -359,7 +663,31 @@ async fn main() -> Result<(), rocket::Error> {
         .await?;
 
     let shutdown = rocket.shutdown();
-    tokio::spawn(generator_loop(state_for_generator, shutdown));
+    tokio::spawn(generator_loop(
+        state_for_generator,
+        config.clone(),
+        replay,
+        shutdown.clone(),
+    ));
+    // Listening on all interfaces means we can reach ourselves on localhost
+    let address = match address {
+        Ok(address) if !address.is_unspecified() => address.to_string(),
+        _ => String::from("127.0.0.1"),
+    };
+    for _ in 0..config.slow_consumers {
+        tokio::spawn(slow_consumer(
+            format!("{address}:{port}"),
+            Duration::from_millis(config.slow_consumer_delay_ms),
+            shutdown.clone(),
+        ));
+    }
+    if config.report_interval > 0 {
+        tokio::spawn(stats_reporter(
+            stats,
+            Duration::from_secs(config.report_interval),
+            shutdown,
+        ));
+    }
 
     let _result = rocket.launch().await?;
     Ok(())
@@ -1,14 +1,13 @@
-#include <Adafruit_BMP085.h>
-#include <Adafruit_MPU6050.h>
 #include <Arduino.h>
 #include <ArduinoJson.h>
-#include <DNSServer.h>  // part of ESP32 arduino core
+#include <AsyncUDP.h>  // part of ESP32 arduino core
 // This previously said "Because we're already keeping a buffer, fail quick in
 // the webserver side of things." but the lower this is, the less quickly we can
 // catch up if someone connects.
 #define SSE_MAX_QUEUED_MESSAGES 16
 #include <ESPAsyncWebServer.h>
 #include <EasyButton.h>
+#include <Preferences.h>  // part of ESP32 arduino core
 #include <RingBuf.h>
 #include <TFT_eSPI.h>
 #include <WiFi.h>  // this as well
@@ -20,6 +19,7 @@
 #include "chart_v3_9_1_min_js.h"
 #include "index_html.h"
 #include "nyancat_bmp.h"
+#include "sensors.h"
 
 // Change these to your desired flavors
 const char *ssid = "Telemetry";     // Enter SSID here
@@ -40,18 +40,96 @@ IPAddress subnet(255, 255, 255, 0);
 #define BUTTON_WIDTH 80
 #define BUTTON_HEIGHT 40
 
-DNSServer dnsServer;
+// Event IDs carry a boot epoch in the top bits and a sequence number in the
+// rest, so a client that reconnects after a reboot can't mistake our new
+// events for ones it already has. IDs stay below 2^31 because the library
+// parses the Last-Event-ID header with atoi(). At 100 events per second the
+// sequence lasts over 46 hours, which is longer than any battery, but if it
+// does run out we carry on in the next epoch, see start_new_epoch().
+#define EVENT_ID_SEQUENCE_BITS 24
+#define EVENT_ID_SEQUENCE_MASK ((1UL << EVENT_ID_SEQUENCE_BITS) - 1)
+#define EVENT_ID_MAX_EPOCH 127
+
+// WebSocket clients start out with this many frames they will accept, and
+// hand out more as they process them.
+#define WS_INITIAL_CREDITS 16
+// The WebSocket handler runs on the async_tcp task, but ws_clients belongs to
+// the loop, so the handler only queues what clients asked for.
+#define WS_REQUEST_QUEUE_LENGTH 32
+
+// While idle we run the CPU slower, and sleep between wakeups instead of
+// polling. /start, button 1 and new clients wake the loop immediately.
+#define ACTIVE_CPU_MHZ 240
+#define IDLE_CPU_MHZ 80
+#define IDLE_WAKEUP_MS 1000
+#define IDLE_DISPLAY_INTERVAL_MS 1000
+#define KEEPALIVE_INTERVAL_MS 10000
+// The softAP doesn't do modem sleep, and turning down the transmit power
+// isn't worth it either. With nobody connected all we send is beacons, which
+// take hardly any airtime, and weaker beacons just make it harder for a phone
+// at the edge of range to find us and join.
+
+// Captive portal DNS. Every name resolves to us. Each client gets a token
+// bucket, so a phone's connectivity probe storm can't swamp the network stack
+// for everyone else.
+#define DNS_PORT 53
+#define DNS_TTL 60
+#define DNS_MAX_PACKET 512
+#define DNS_RATE_PER_SECOND 20
+#define DNS_BURST 40
+#define DNS_RATE_LIMIT_CLIENTS 8
+
+// Latency from reading the sensors to handing a telemetry event to a client,
+// live or from the backlog. The histogram has 2^LATENCY_SUB_BUCKET_BITS
+// buckets per power of two microseconds, so recording is O(1), and the
+// percentiles are within 12.5%.
+#define LATENCY_SUB_BUCKET_BITS 3
+#define LATENCY_BUCKETS \
+    ((33 - LATENCY_SUB_BUCKET_BITS) << LATENCY_SUB_BUCKET_BITS)
+
+AsyncUDP dns_udp;
+Preferences preferences;
 AsyncWebServer webServer(80);
 AsyncEventSource events("/events");
+AsyncWebSocket ws("/ws");
+struct dns_rate_limit_t {
+    uint32_t ip;
+    uint32_t last_ms;
+    uint16_t tokens;
+};
+dns_rate_limit_t dns_rate_limits[DNS_RATE_LIMIT_CLIENTS];
+// The part of an answer that comes after the question is always the same: a
+// pointer to the name in the question, type A, class IN, TTL, and our IP.
+uint8_t dns_answer[16];
+// Built once, instead of for every request that needs redirecting
+String portal_host;
+String portal_url;
 struct client_t {
     AsyncEventSourceClient *client;
     uint32_t last_id;
 };
 std::vector<client_t *> clients;
+// WebSocket clients get looked up by ID every time, because the library
+// deletes the client object when it disconnects. Only touched by the loop.
+// Clients ack a running total of frames they've processed, so a lost ack is
+// made up for by the next one, and can't shrink the window for good.
+struct ws_client_t {
+    uint32_t id;
+    uint32_t last_id;
+    uint32_t sent;
+    uint32_t acked;
+};
+std::vector<ws_client_t *> ws_clients;
+enum ws_request_type_t { WS_REQUEST_RESUME, WS_REQUEST_ACK };
+struct ws_request_t {
+    ws_request_type_t type;
+    uint32_t client_id;
+    uint32_t value;  // last_id for RESUME, the running total for ACK
+};
+QueueHandle_t ws_requests = NULL;
 
 hw_timer_t *timer = NULL;
-Adafruit_BMP085 bmp;
-Adafruit_MPU6050 mpu;
+SensorBackend sensors;
 TFT_eSPI tft = TFT_eSPI();
 EasyButton button1(BUTTON_1);
 EasyButton button2(BUTTON_2);
@@ -66,8 +144,31 @@ float max_z_accel = NAN;
 float prev_max_z_accel = NAN;
 float prev_battery_voltage = NAN;
 float prev_temperature = NAN;
+uint8_t boot_epoch = 0;
 uint32_t event_id = 0;
-uint32_t loop_counter = 0;
+TaskHandle_t loop_task = NULL;
+bool idle_power_saving = false;
+unsigned long idle_start_ms = 0;
+unsigned long idle_asleep_ms = 0;
+float idle_start_battery_voltage = NAN;
+unsigned long last_keepalive_ms = 0;
+unsigned long last_idle_display_ms = 0;
+volatile unsigned long start_requested_us = 0;
+bool first_sample_pending = false;
+// ID of the last telemetry_started, so we know who was following the last run
+uint32_t last_started_id = 0;
+// What the last idle period looked like, reported when telemetry starts
+unsigned long last_idle_ms = 0;
+float last_idle_asleep_percent = NAN;
+float last_idle_battery_drop = NAN;
+// Reset for every run, and reported once every client has caught up after
+// it stops, or when the next run starts, whichever comes first
+bool latency_report_pending = false;
+uint32_t latency_buckets[LATENCY_BUCKETS];
+uint32_t latency_count = 0;
+uint32_t latency_max_us = 0;
+uint32_t events_missed = 0;    // told to clients in "gap" resyncs
+uint32_t clients_dropped = 0;  // SSE clients that fell too far behind
 volatile bool backlight_on = true;  // it is on by default
 bool backlight_requested = true;
 bool send_parameters = false;
@@ -80,24 +181,76 @@ void handle_start(AsyncWebServerRequest *request);
 void handle_stop(AsyncWebServerRequest *request);
 void handle_calibrate(AsyncWebServerRequest *request);
 void handle_parameter(AsyncWebServerRequest *request);
+void handle_ws_event(AsyncWebSocket *server, AsyncWebSocketClient *client,
+                     AwsEventType type, void *arg, uint8_t *data, size_t len);
+const char *request_start();
+const char *request_stop();
+const char *request_calibration();
+bool set_parameter(const String &name, const String &value);
 void init_sensors();
+void init_event_ids();
+void start_new_epoch();
+void init_dns();
+uint8_t event_epoch(uint32_t id);
 void do_telemetry();
 void do_idle();
-void send_event(const char *message, const char *event);
+struct telemetry_frame_t;
+void send_event(const char *message, const char *event,
+                telemetry_frame_t *frame = NULL, uint32_t sampled_us = 0);
 void draw_grid();
 void draw_button_labels();
 void draw_telemetry();
 float calc_battery_voltage();
 void send_parameters_event();
+void send_stats_event(unsigned long time_to_first_sample_us);
+void send_keepalive();
+bool catch_clients_up();
+uint32_t resume_point(uint32_t last_id);
+void wake_loop();
+void enter_idle_power();
+void leave_idle_power();
+void record_latency(uint32_t sampled_us);
+void reset_latency();
+void report_latency();
+String make_resync_json(const char *reason, uint32_t first_missing,
+                        uint32_t last_missing);
+String make_ws_envelope(const char *message, const char *event, uint32_t id);
+void handle_ws_requests();
+void send_resync_event(AsyncEventSourceClient *client, const char *reason,
+                       uint32_t first_missing, uint32_t last_missing);
 
-void button1_ISR() { button1.read(); }
+void button1_ISR() {
+    button1.read();
+    if (loop_task != NULL) {
+        vTaskNotifyGiveFromISR(loop_task, NULL);
+    }
+}
 void button2_ISR() { button2.read(); }
 
 struct message_t {
     uint32_t event_id;
     char *message;
     char *event;
+    uint32_t sampled_us;  // 0 if it isn't telemetry
+};
+
+// Binary telemetry frame for WebSocket clients, little endian like the ESP32
+// itself. Has to match decode_telemetry_frame() in index.html.
+struct __attribute__((packed)) telemetry_frame_t {
+    uint32_t event_id;
+    uint32_t time;
+    float acceleration_x;
+    float acceleration_y;
+    float acceleration_z;
+    float gyro_x;
+    float gyro_y;
+    float gyro_z;
+    float pressure;
+    float altitude;
+    float bmp_temperature;
+    float mpu_temperature;
 };
+static_assert(sizeof(telemetry_frame_t) == 48, "telemetry frame is padded");
 
 /* Measured to be roughly half the RAM left over */
 RingBuf<message_t, 256> message_queue;
@@ -106,14 +259,17 @@ String empty_weight = "0.0";
 String water_weight = "0.0";
 String air_pressure = "0.0";
 
-mpu6050_accel_range_t accel_range = MPU6050_RANGE_8_G;
-mpu6050_accel_range_t requested_accel_range = MPU6050_RANGE_8_G;
-mpu6050_gyro_range_t gyro_range = MPU6050_RANGE_500_DEG;
-mpu6050_gyro_range_t requested_gyro_range = MPU6050_RANGE_500_DEG;
-mpu6050_bandwidth_t filter_bandwidth = MPU6050_BAND_21_HZ;
-mpu6050_bandwidth_t requested_filter_bandwidth = MPU6050_BAND_21_HZ;
+// In G, deg/s and Hz. Has to be in the backend's tables, see sensors.h
+int accel_range = 8;
+int requested_accel_range = 8;
+int gyro_range = 500;
+int requested_gyro_range = 500;
+int filter_bandwidth = 21;
+int requested_filter_bandwidth = 21;
 
 void setup() {
+    // setup() and loop() run on the same task
+    loop_task = xTaskGetCurrentTaskHandle();
     message_queue.clear();
     Serial.begin(115200);
     Serial.println("DEBUG: Starting up");
@@ -135,6 +291,9 @@ void setup() {
         Serial.println("Button 1 pressed");
         calibration_requested = true;
         telemetry_requested = !telemetry_requested;
+        if (telemetry_requested) {
+            start_requested_us = micros();
+        }
     });
     button2.onPressed([]() {
         Serial.println("Button 2 pressed");
@@ -155,6 +314,8 @@ void setup() {
     Serial.println("DEBUG: Initializing Sensors");
     init_sensors();
 
+    init_event_ids();
+
     Serial.println("DEBUG: Initializing WiFi");
     Serial.println("");
     WiFi.softAP(ssid, password);
@@ -162,6 +323,8 @@ void setup() {
 
     delay(100);
     Serial.println("Access point started");
+    portal_host = WiFi.softAPIP().toString();
+    portal_url = "http://" + portal_host;
 
     webServer.on("/", handle_root);
     webServer.on("/chart-v3.9.1.min.js", handle_chartjs);
@@ -173,50 +336,61 @@ void setup() {
     webServer.on("/parameter", handle_parameter);
     webServer.onNotFound(handle_not_found);
     events.onConnect([](AsyncEventSourceClient *client) {
-        if (client->lastId()) {
+        uint32_t last_id = client->lastId();
+        if (last_id) {
             Serial.printf(
                 "Client reconnected! Last message ID that it got is: %u\n",
-                client->lastId());
+                last_id);
+        }
+        if (last_id && event_epoch(last_id) != boot_epoch) {
+            // It was connected before we rebooted, so nothing it has lines
+            // up with what we have. Tell it, and treat it like a new client.
+            send_resync_event(client, "reboot", 0, 0);
+            last_id = 0;
         }
         client_t *c = new client_t;
         c->client = client;
-        // if we're idle, don't catch client up
-        if (!telemetry_running) {
-            c->last_id = event_id;
-        } else {
-            c->last_id = client->lastId();
+        c->last_id = resume_point(last_id);
+        if (last_id && c->last_id > last_id) {
+            send_resync_event(client, "gap", last_id + 1, c->last_id);
+        }
+        if (c->last_id == event_id && !telemetry_running) {
+            // It won't be hearing about the last run ending, so tell it
+            // we're idle, or a page that missed it thinks we're still running
+            client->send("", "idle");
         }
         clients.push_back(c);
         // but do make sure we spread the parameters
         send_parameters = true;
+        wake_loop();
     });
     webServer.addHandler(&events);
+    ws_requests = xQueueCreate(WS_REQUEST_QUEUE_LENGTH, sizeof(ws_request_t));
+    ws.onEvent(handle_ws_event);
+    webServer.addHandler(&ws);
     webServer.begin();
     Serial.println("HTTP server started");
 
-    dnsServer.start(53, "*", local_ip);
-    Serial.println("DNS server started");
+    init_dns();
 }
 
 void loop() {
-    loop_counter++;
-    dnsServer.processNextRequest();
-
     // flip backlight if needed.
     // don't do anything until after a few seconds, to
     // allow the backlight button label to be seen, since
     // the default is to turn the backlight off.
-    if (loop_counter > 20 && backlight_on != backlight_requested) {
+    if (millis() > 2000 && backlight_on != backlight_requested) {
         digitalWrite(BACKLIGHT_PIN, backlight_requested ? HIGH : LOW);
         backlight_on = backlight_requested;
     }
 
     if (calibration_requested) {
         Serial.println("Calibration requested");
-        zero_pressure = bmp.readPressure();
+        zero_pressure = sensors.read_pressure();
         Serial.printf("Zero pressure: %f Pa\n", zero_pressure);
         calibration_requested = false;
     }
+    handle_ws_requests();
     if (send_parameters) {
         send_parameters_event();
         send_parameters = false;
@@ -228,39 +402,90 @@ void loop() {
     }
 }
 
-// Bisect the backlog to find the given event_id. There need to be _some_
-// messages in the backlog.
-uint16_t bisect_backlog(uint32_t event_id) {
-    // Before we start bisecting, we need to check that the event_id is in
-    // the backlog at all. If it's not, just return the index for the
-    // earliest event we do have.
-    if (message_queue[0].event_id > event_id) {
-        return 0;
+uint8_t event_epoch(uint32_t id) { return id >> EVENT_ID_SEQUENCE_BITS; }
+
+void init_event_ids() {
+    // Every boot gets the next epoch, skipping 0 so that an ID is never 0,
+    // which is what lastId() returns for clients that have none.
+    preferences.begin("telemetry", false);
+    boot_epoch = preferences.getUChar("boot_epoch", 0) % EVENT_ID_MAX_EPOCH + 1;
+    preferences.putUChar("boot_epoch", boot_epoch);
+    preferences.end();
+    event_id = (uint32_t)boot_epoch << EVENT_ID_SEQUENCE_BITS;
+    Serial.printf("Boot epoch: %u\n", boot_epoch);
+}
+
+// Only when the sequence runs out, which would otherwise spill into the epoch
+// bits. Everything in the backlog and everything clients have seen is from
+// the old epoch, so the backlog goes, anyone still catching up is told what
+// they lost like when the backlog rolls past them, and everyone carries on
+// from the new epoch. A client that reconnects with an old ID later gets a
+// "reboot" resync, same as after a real reboot.
+void start_new_epoch() {
+    uint32_t last_old_id = event_id;
+    init_event_ids();
+    for (client_t *client : clients) {
+        if (client->last_id < last_old_id && client->client->connected()) {
+            send_resync_event(client->client, "gap", client->last_id + 1,
+                              last_old_id);
+            events_missed += last_old_id - client->last_id;
+        }
+        client->last_id = event_id;
     }
-    uint16_t len = message_queue.size();
+    for (ws_client_t *c : ws_clients) {
+        AsyncWebSocketClient *client = ws.client(c->id);
+        if (client != NULL && c->last_id < last_old_id) {
+            String resync =
+                make_resync_json("gap", c->last_id + 1, last_old_id);
+            client->text(make_ws_envelope(resync.c_str(), "resync", 0));
+            c->sent++;
+            events_missed += last_old_id - c->last_id;
+        }
+        c->last_id = event_id;
+    }
+    while (!message_queue.isEmpty()) {
+        message_t to_delete;
+        message_queue.pop(to_delete);
+        free(to_delete.message);
+        free(to_delete.event);
+    }
+}
+
+// Bisect the backlog to find the first message with an event_id of at least
+// the given one. Within an epoch IDs are sequential, so that is exactly the
+// given event_id if we still have it. Returns the size of the backlog if
+// every message in it is older.
+uint16_t bisect_backlog(uint32_t event_id) {
     uint16_t start = 0;
-    uint16_t end = len;
-    uint16_t mid = (start + end) / 2;
+    uint16_t end = message_queue.size();
     while (start < end) {
-        if (message_queue[mid].event_id == event_id) {
-            return mid;
-        }
+        uint16_t mid = (start + end) / 2;
         if (message_queue[mid].event_id < event_id) {
             start = mid + 1;
         } else {
             end = mid;
         }
-        mid = (start + end) / 2;
     }
-    // We somehow didn't find the event_id, so lets just return the first
-    // message we have. Could be the client gave a corrupt event_id
-    return 0;
+    return start;
+}
+
+// Whether a client has seen events from this epoch, but the backlog has
+// rolled past them. Clients get told exactly which ones they won't be getting.
+bool missed_backlog(uint32_t last_id) {
+    return message_queue.size() > 0 && event_epoch(last_id) == boot_epoch &&
+           message_queue[0].event_id > last_id + 1;
 }
 
 bool catch_client_up(client_t *client) {
     bool return_value = false;
     uint16_t backlog_len = message_queue.size();
     uint16_t backlog_start = bisect_backlog(client->last_id + 1);
+    if (missed_backlog(client->last_id)) {
+        send_resync_event(client->client, "gap", client->last_id + 1,
+                          message_queue[0].event_id - 1);
+        events_missed += message_queue[0].event_id - 1 - client->last_id;
+        client->last_id = message_queue[0].event_id - 1;
+    }
     uint16_t messages_to_send = backlog_len - backlog_start;
     uint16_t space_in_client_queue =
         SSE_MAX_QUEUED_MESSAGES - client->client->packetsWaiting();
@@ -271,16 +496,103 @@ bool catch_client_up(client_t *client) {
     }
     for (uint16_t i = 0; i < messages_to_send; i++) {
         message_t message = message_queue[backlog_start + i];
-        client->client->send(message.message, message.event);
+        // With the ID, so the browser's Last-Event-ID keeps up, and a
+        // reconnect halfway through doesn't get these again.
+        client->client->send(message.message, message.event,
+                             message.event_id);
         client->last_id = message.event_id;
+        record_latency(message.sampled_us);
     }
     return return_value;
 }
 
-void send_event(const char *message_text, const char *event) {
+// WebSocket clients get non-telemetry events, and anything from the backlog,
+// as a JSON text frame with the event name and ID alongside the data.
+String make_ws_envelope(const char *message, const char *event, uint32_t id) {
+    String envelope;
+    envelope.reserve(strlen(message) + strlen(event) + 40);
+    envelope += "{\"event\":\"";
+    envelope += event;
+    envelope += "\",\"id\":";
+    envelope += id;
+    envelope += ",\"data\":";
+    envelope += *message ? message : "null";
+    envelope += "}";
+    return envelope;
+}
+
+int32_t ws_credits(ws_client_t *c) {
+    return WS_INITIAL_CREDITS - (int32_t)(c->sent - c->acked);
+}
+
+bool catch_ws_client_up(ws_client_t *c, AsyncWebSocketClient *client) {
+    uint16_t backlog_len = message_queue.size();
+    uint16_t backlog_index = bisect_backlog(c->last_id + 1);
+    if (missed_backlog(c->last_id) && ws_credits(c) > 0) {
+        String resync = make_resync_json("gap", c->last_id + 1,
+                                         message_queue[0].event_id - 1);
+        client->text(make_ws_envelope(resync.c_str(), "resync", 0));
+        c->sent++;
+        events_missed += message_queue[0].event_id - 1 - c->last_id;
+        c->last_id = message_queue[0].event_id - 1;
+    }
+    while (backlog_index < backlog_len) {
+        if (ws_credits(c) <= 0 || client->queueIsFull()) {
+            return false;
+        }
+        message_t message = message_queue[backlog_index++];
+        client->text(
+            make_ws_envelope(message.message, message.event, message.event_id));
+        c->sent++;
+        c->last_id = message.event_id;
+        record_latency(message.sampled_us);
+    }
+    return true;
+}
+
+void send_ws_event(const char *message_text, const char *event,
+                   telemetry_frame_t *frame, uint32_t sampled_us) {
+    ws_clients.erase(
+        std::remove_if(ws_clients.begin(), ws_clients.end(),
+                       [&](ws_client_t *c) {
+                           AsyncWebSocketClient *client = ws.client(c->id);
+                           if (client == NULL) {
+                               delete c;
+                               return true;
+                           }
+                           // Unlike SSE, a client that falls behind just stops
+                           // handing out credits, so there's no need to
+                           // disconnect it. It'll catch up from the backlog.
+                           bool caught_up = true;
+                           if (c->last_id < event_id - 1) {
+                               caught_up = catch_ws_client_up(c, client);
+                           }
+                           if (caught_up && ws_credits(c) > 0 &&
+                               !client->queueIsFull()) {
+                               if (frame != NULL) {
+                                   client->binary((const char *)frame,
+                                                  sizeof(*frame));
+                               } else {
+                                   client->text(make_ws_envelope(
+                                       message_text, event, event_id));
+                               }
+                               c->sent++;
+                               c->last_id = event_id;
+                               record_latency(sampled_us);
+                           }
+                           return false;
+                       }),
+        ws_clients.end());
+}
+
+void send_event(const char *message_text, const char *event,
+                telemetry_frame_t *frame, uint32_t sampled_us) {
     const char *message_to_send;
     message_t message;
 
+    if ((event_id & EVENT_ID_SEQUENCE_MASK) == EVENT_ID_SEQUENCE_MASK) {
+        start_new_epoch();
+    }
     event_id++;
 
     if (message_text == NULL) {
@@ -310,6 +622,7 @@ void send_event(const char *message_text, const char *event) {
                                        "queued, disconnecting\n",
                                        client->client);
                                    client->client->close();
+                                   clients_dropped++;
                                }
                                delete client;
                                return true;
@@ -326,11 +639,17 @@ void send_event(const char *message_text, const char *event) {
                                client->client->send(message_to_send, event,
                                                     event_id);
                                client->last_id = event_id;
+                               record_latency(sampled_us);
                            }
                            return false;
                        }),
         clients.end());
 
+    if (frame != NULL) {
+        frame->event_id = event_id;
+    }
+    send_ws_event(message_to_send, event, frame, sampled_us);
+
     // This is the only place we add/remove, but we will read elsewhere,
     // make sure those are in the main loop, like here.
     if (message_queue.isFull()) {
@@ -339,71 +658,103 @@ void send_event(const char *message_text, const char *event) {
         free(to_delete.message);
         free(to_delete.event);
     }
-    message_queue.push({event_id, strdup(message_to_send), strdup(event)});
+    message_queue.push(
+        {event_id, strdup(message_to_send), strdup(event), sampled_us});
 }
 
 void do_telemetry() {
+    // The splash is for show, it doesn't count towards waking up
+    unsigned long splash_us = 0;
     if (!telemetry_running) {
         Serial.println("Starting telemetry");
+        leave_idle_power();
+        unsigned long splash_start = micros();
         int rotation = tft.getRotation();
         tft.setRotation(7);
         tft.pushImage(0, 0, SCREEN_WIDTH, SCREEN_HEIGHT, nyancat_bmp);
         delay(2000);
+        splash_us = micros() - splash_start;
         tft.setRotation(rotation);
         tft.fillScreen(TFT_BLACK);
         max_altitude = NAN;
         max_z_accel = NAN;
         prev_max_altitude = NAN;
         prev_max_z_accel = NAN;
+        if (latency_report_pending) {
+            // Somebody never caught up, so this is all we got
+            report_latency();
+        }
+        reset_latency();
         telemetry_running = true;
+        // Right before the timer, so a replay lines up with the time field
+        sensors.start_run();
         assert(timer == NULL);
         timer = timerBegin(0, 80, true);
         // like the _stopped event, we don't want any idle events
         // after the _started event. So we send it here instead of
         // handle_start.
         send_event(NULL, "telemetry_started");
+        last_started_id = event_id;
+        first_sample_pending = true;
     }
     unsigned long read_sensor_start = micros();
-    sensors_event_t a, g, temp;
-    mpu.getEvent(&a, &g, &temp);
-    float pressure = bmp.readPressure();
-    float altitude = bmp.readAltitude(zero_pressure);
-    float temperature = bmp.readTemperature();
+    sensor_sample_t sample;
+    sensors.read(sample, zero_pressure);
     unsigned long read_sensor_end = micros();
+    // 0 means "not telemetry" to the latency bookkeeping, being 1us off
+    // doesn't matter.
+    uint32_t sampled_us = read_sensor_end | 1;
     unsigned long read_sensor_duration = read_sensor_end - read_sensor_start;
     unsigned long make_json_start = micros();
+    uint32_t time = timerReadMilis(timer);
     const int capacity = JSON_OBJECT_SIZE(11);
     StaticJsonDocument<capacity> json;
-    json["time"] = timerReadMilis(timer);
-    json["acceleration_x"] = a.acceleration.x;
-    json["acceleration_y"] = a.acceleration.y;
-    json["acceleration_z"] = a.acceleration.z;
-    json["gyro_x"] = g.gyro.x;
-    json["gyro_y"] = g.gyro.y;
-    json["gyro_z"] = g.gyro.z;
-    json["pressure"] = pressure;
-    json["altitude"] = altitude;
-    json["bmp_temperature"] = temperature;
-    json["mpu_temperature"] = temp.temperature;
+    json["time"] = time;
+    json["acceleration_x"] = sample.acceleration_x;
+    json["acceleration_y"] = sample.acceleration_y;
+    json["acceleration_z"] = sample.acceleration_z;
+    json["gyro_x"] = sample.gyro_x;
+    json["gyro_y"] = sample.gyro_y;
+    json["gyro_z"] = sample.gyro_z;
+    json["pressure"] = sample.pressure;
+    json["altitude"] = sample.altitude;
+    json["bmp_temperature"] = sample.bmp_temperature;
+    json["mpu_temperature"] = sample.mpu_temperature;
     String json_string = "";
     serializeJson(json, json_string);
+    telemetry_frame_t frame;
+    frame.time = time;
+    frame.acceleration_x = sample.acceleration_x;
+    frame.acceleration_y = sample.acceleration_y;
+    frame.acceleration_z = sample.acceleration_z;
+    frame.gyro_x = sample.gyro_x;
+    frame.gyro_y = sample.gyro_y;
+    frame.gyro_z = sample.gyro_z;
+    frame.pressure = sample.pressure;
+    frame.altitude = sample.altitude;
+    frame.bmp_temperature = sample.bmp_temperature;
+    frame.mpu_temperature = sample.mpu_temperature;
     unsigned long make_json_end = micros();
     unsigned long make_json_duration = make_json_end - make_json_start;
     unsigned long send_event_start = micros();
-    send_event(json_string.c_str(), "telemetry");
+    send_event(json_string.c_str(), "telemetry", &frame, sampled_us);
     unsigned long send_event_end = micros();
     unsigned long send_event_duration = send_event_end - send_event_start;
+    if (first_sample_pending) {
+        send_stats_event(read_sensor_end - start_requested_us - splash_us);
+        first_sample_pending = false;
+    }
     // Serial.printf("Read sensor: %lu us, make json: %lu us, send event:
     // %lu us\n", read_sensor_duration, make_json_duration,
     // send_event_duration);
 
     // update max_altitude if higher or if max is NAN
-    if (isnan(max_altitude) || altitude > max_altitude) {
-        max_altitude = altitude;
+    if (isnan(max_altitude) || sample.altitude > max_altitude) {
+        max_altitude = sample.altitude;
     }
     // update max_z_accel if higher or if max is NAN
-    if (isnan(max_z_accel) || a.acceleration.z > max_z_accel) {
-        max_z_accel = a.acceleration.z;
+    if (isnan(max_z_accel) || sample.acceleration_z > max_z_accel) {
+        max_z_accel = sample.acceleration_z;
     }
 
     if (max_altitude != prev_max_altitude || max_z_accel != prev_max_z_accel) {
@@ -437,16 +788,27 @@ void do_idle() {
         // want any telemetry events after the _stopped event. Which
         // would happen if we sent the event in handle_stop.
         send_event(NULL, "telemetry_stopped");
+        // Not yet, the slowest clients are still catching up, and they're
+        // the ones that make the tail
+        latency_report_pending = true;
         tft.fillScreen(TFT_BLACK);
         prev_temperature = NAN;
         prev_battery_voltage = NAN;
         prev_buf[0] = '\0';
     }
-    // only send idle events or do display updates every 10 loops
-    if (loop_counter % 10 == 0) {
-        send_event(NULL, "idle");
+    enter_idle_power();
+    unsigned long now = millis();
+    // Clients only need to know we're still here, which doesn't need a
+    // real event that wakes up every page and takes up backlog.
+    if (now - last_keepalive_ms >= KEEPALIVE_INTERVAL_MS) {
+        send_keepalive();
+        last_keepalive_ms = now;
+    }
+    // only do display updates every so often
+    if (now - last_idle_display_ms >= IDLE_DISPLAY_INTERVAL_MS) {
+        last_idle_display_ms = now;
         // update the temperature and battery readings if they have changed
-        float temperature = bmp.readTemperature();
+        float temperature = sensors.read_temperature();
         float battery_voltage = calc_battery_voltage();
         if (temperature != prev_temperature ||
             battery_voltage != prev_battery_voltage) {
@@ -468,26 +830,180 @@ void do_idle() {
             }
         }
     }
-    // TODO: Catch clients up since we have the time
+    if (catch_clients_up() && latency_report_pending) {
+        report_latency();
+    }
 
     // Set sensor parameters if requested
     bool send_event = false;
     if (requested_accel_range != accel_range) {
         accel_range = requested_accel_range;
-        mpu.setAccelerometerRange(accel_range);
+        sensors.set_accel_range(accel_range);
     }
     if (requested_gyro_range != gyro_range) {
         gyro_range = requested_gyro_range;
-        mpu.setGyroRange(gyro_range);
+        sensors.set_gyro_range(gyro_range);
     }
     if (requested_filter_bandwidth != filter_bandwidth) {
         filter_bandwidth = requested_filter_bandwidth;
-        mpu.setFilterBandwidth(filter_bandwidth);
+        sensors.set_filter_bandwidth(filter_bandwidth);
     }
     if (send_event) {
         send_parameters_event();
     }
-    delay(100);
+    // Sleep until the next wakeup, or until someone needs us
+    unsigned long sleep_start = millis();
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(IDLE_WAKEUP_MS));
+    idle_asleep_ms += millis() - sleep_start;
+}
+
+// Normally clients get caught up as new events go out, but while idle there
+// aren't any. Without this, a client that was behind when the run stopped, or
+// a WebSocket client out of credit, would wait for the next run to see the
+// end of this one. Returns whether everybody is caught up.
+bool catch_clients_up() {
+    bool caught_up = true;
+    for (client_t *client : clients) {
+        // If the client isn't connected, packetsWaiting() can cause a crash
+        if (client->client->connected() && client->last_id < event_id) {
+            caught_up &= catch_client_up(client);
+        }
+    }
+    for (ws_client_t *c : ws_clients) {
+        AsyncWebSocketClient *client = ws.client(c->id);
+        if (client != NULL && c->last_id < event_id) {
+            caught_up &= catch_ws_client_up(c, client);
+        }
+    }
+    return caught_up;
+}
+
+// Where a (re)connecting client picks up. While idle, only a client that was
+// following the last run gets caught up, so it still sees the end of it and
+// telemetry_stopped. Everybody else starts from now, and a client that had
+// seen something before gets a gap resync for what it skips, like it would
+// for the backlog rolling over.
+uint32_t resume_point(uint32_t last_id) {
+    if (telemetry_running ||
+        (last_id && last_started_id && last_id >= last_started_id)) {
+        return last_id;
+    }
+    return event_id;
+}
+
+void wake_loop() {
+    if (loop_task != NULL) {
+        xTaskNotifyGive(loop_task);
+    }
+}
+
+void enter_idle_power() {
+    if (idle_power_saving) {
+        return;
+    }
+    setCpuFrequencyMhz(IDLE_CPU_MHZ);
+    idle_power_saving = true;
+    idle_start_ms = millis();
+    idle_asleep_ms = 0;
+    idle_start_battery_voltage = calc_battery_voltage();
+}
+
+void leave_idle_power() {
+    if (!idle_power_saving) {
+        return;
+    }
+    setCpuFrequencyMhz(ACTIVE_CPU_MHZ);
+    idle_power_saving = false;
+    // We don't have a current sensor, so the best we can do is how much of
+    // the time we were asleep, and what that did to the battery.
+    last_idle_ms = millis() - idle_start_ms;
+    last_idle_asleep_percent =
+        last_idle_ms ? 100.0 * idle_asleep_ms / last_idle_ms : NAN;
+    last_idle_battery_drop =
+        idle_start_battery_voltage - calc_battery_voltage();
+}
+
+// Buckets below 2^(LATENCY_SUB_BUCKET_BITS + 1) are exact. Above that, the
+// top bit picks the power of two, and the bits below it the sub bucket.
+uint16_t latency_bucket(uint32_t us) {
+    if (us < (2 << LATENCY_SUB_BUCKET_BITS)) {
+        return us;
+    }
+    int top_bit = 31 - __builtin_clz(us);
+    int shift = top_bit - LATENCY_SUB_BUCKET_BITS;
+    uint16_t sub_bucket = (us >> shift) & ((1 << LATENCY_SUB_BUCKET_BITS) - 1);
+    return ((shift + 1) << LATENCY_SUB_BUCKET_BITS) + sub_bucket;
+}
+
+// The lowest latency that ends up in a bucket
+uint32_t latency_bucket_start(uint16_t bucket) {
+    if (bucket < (2 << LATENCY_SUB_BUCKET_BITS)) {
+        return bucket;
+    }
+    int shift = (bucket >> LATENCY_SUB_BUCKET_BITS) - 1;
+    uint32_t sub_bucket = bucket & ((1 << LATENCY_SUB_BUCKET_BITS) - 1);
+    return ((1 << LATENCY_SUB_BUCKET_BITS) + sub_bucket) << shift;
+}
+
+void record_latency(uint32_t sampled_us) {
+    if (sampled_us == 0) {
+        return;
+    }
+    uint32_t latency_us = micros() - sampled_us;
+    latency_buckets[latency_bucket(latency_us)]++;
+    latency_count++;
+    if (latency_us > latency_max_us) {
+        latency_max_us = latency_us;
+    }
+}
+
+void reset_latency() {
+    memset(latency_buckets, 0, sizeof(latency_buckets));
+    latency_count = 0;
+    latency_max_us = 0;
+    events_missed = 0;
+    clients_dropped = 0;
+}
+
+uint32_t latency_percentile(float percentile) {
+    uint32_t wanted = ceil(latency_count * percentile / 100);
+    uint32_t seen = 0;
+    for (uint16_t bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+        seen += latency_buckets[bucket];
+        if (seen >= wanted && seen > 0) {
+            return latency_bucket_start(bucket);
+        }
+    }
+    return 0;
+}
+
+// One line, so runs with different settings are easy to compare
+void report_latency() {
+    latency_report_pending = false;
+    Serial.printf(
+        "Latency: %u deliveries, p50 %u us, p90 %u us, p99 %u us, max %u us, "
+        "%u events missed, %u clients dropped\n",
+        latency_count, latency_percentile(50), latency_percentile(90),
+        latency_percentile(99), latency_max_us, events_missed,
+        clients_dropped);
+}
+
+// SSE comments and WebSocket pings keep connections open without the page
+// having to do anything.
+void send_keepalive() {
+    for (client_t *client : clients) {
+        // If the client isn't connected, packetsWaiting() can cause a crash
+        if (client->client->connected() &&
+            client->client->packetsWaiting() < SSE_MAX_QUEUED_MESSAGES) {
+            client->client->write(":\n\n", 3);
+        }
+    }
+    for (ws_client_t *c : ws_clients) {
+        AsyncWebSocketClient *client = ws.client(c->id);
+        if (client != NULL) {
+            client->ping();
+        }
+    }
 }
 
 void draw_button_labels() {
@@ -564,8 +1080,8 @@ void handle_file(AsyncWebServerRequest *request, const String &content_type,
 }
 
 void handle_root(AsyncWebServerRequest *request) {
-    if (request->host() != WiFi.softAPIP().toString()) {
-        request->redirect("http://" + WiFi.softAPIP().toString());
+    if (request->host() != portal_host) {
+        request->redirect(portal_url);
     } else {
         handle_file(request, "text/html", index_html, index_html_length);
     }
@@ -581,287 +1097,442 @@ void handle_filesaver(AsyncWebServerRequest *request) {
                 FileSaver_v2_0_5_min_js_length);
 }
 
-void handle_start(AsyncWebServerRequest *request) {
+const char *request_start() {
     if (telemetry_requested) {
-        request->send(200, "text/plain", "Telemetry already running");
-        return;
+        return "Telemetry already running";
     }
+    start_requested_us = micros();
     telemetry_requested = true;
-    request->send(200, "text/plain", "Telemetry started");
+    wake_loop();
+    return "Telemetry started";
 }
 
-void handle_stop(AsyncWebServerRequest *request) {
+const char *request_stop() {
     if (!telemetry_requested) {
-        request->send(200, "text/plain", "Telemetry already stopped");
-        return;
+        return "Telemetry already stopped";
     }
     telemetry_requested = false;
-    request->send(200, "text/plain", "Telemetry stopped");
+    return "Telemetry stopped";
 }
 
-void handle_calibrate(AsyncWebServerRequest *request) {
+const char *request_calibration() {
     calibration_requested = true;
-    request->send(200, "text/plain", "Calibration done");
+    wake_loop();
+    return "Calibration done";
 }
 
-void handle_not_found(AsyncWebServerRequest *request) {
-    if (request->host() != WiFi.softAPIP().toString()) {
-        request->redirect("http://" + WiFi.softAPIP().toString());
+void handle_start(AsyncWebServerRequest *request) {
+    request->send(200, "text/plain", request_start());
+}
+
+void handle_stop(AsyncWebServerRequest *request) {
+    request->send(200, "text/plain", request_stop());
+}
+
+void handle_calibrate(AsyncWebServerRequest *request) {
+    request->send(200, "text/plain", request_calibration());
+}
+
+// Commands come in as small JSON text frames, like {"command": "start"}, and
+// flow control as {"credit": 8}, meaning the client has processed 8 more
+// frames.
+bool queue_ws_request(ws_request_type_t type, uint32_t client_id,
+                      uint32_t value) {
+    ws_request_t request = {type, client_id, value};
+    if (xQueueSend(ws_requests, &request, 0) != pdTRUE) {
+        Serial.println("WebSocket request queue full");
+        return false;
+    }
+    wake_loop();
+    return true;
+}
+
+// A (re)connecting client tells us the last event ID it has, and gets the
+// same treatment as an SSE client with a Last-Event-ID.
+void resume_ws_client(uint32_t id, uint32_t last_id) {
+    AsyncWebSocketClient *client = ws.client(id);
+    if (client == NULL) {
+        return;
+    }
+    for (ws_client_t *c : ws_clients) {
+        if (c->id == id) {
+            return;
+        }
+    }
+    ws_client_t *c = new ws_client_t{id, 0, 0, 0};
+    if (last_id && event_epoch(last_id) != boot_epoch) {
+        String resync = make_resync_json("reboot", 0, 0);
+        client->text(make_ws_envelope(resync.c_str(), "resync", 0));
+        c->sent++;
+        last_id = 0;
+    }
+    c->last_id = resume_point(last_id);
+    // Same as for SSE clients, see onConnect and resume_point()
+    if (last_id && c->last_id > last_id) {
+        String resync = make_resync_json("gap", last_id + 1, c->last_id);
+        client->text(make_ws_envelope(resync.c_str(), "resync", 0));
+        c->sent++;
+    }
+    if (c->last_id == event_id && !telemetry_running) {
+        client->text(make_ws_envelope("", "idle", 0));
+        c->sent++;
+    }
+    ws_clients.push_back(c);
+    send_parameters = true;
+}
+
+// Runs on the loop, so it's safe to touch ws_clients here
+void handle_ws_requests() {
+    ws_request_t request;
+    while (xQueueReceive(ws_requests, &request, 0) == pdTRUE) {
+        if (request.type == WS_REQUEST_RESUME) {
+            resume_ws_client(request.client_id, request.value);
+            continue;
+        }
+        for (ws_client_t *c : ws_clients) {
+            if (c->id == request.client_id &&
+                (int32_t)(request.value - c->acked) > 0) {
+                c->acked = request.value;
+            }
+        }
+    }
+}
+
+void handle_ws_command(AsyncWebSocketClient *client, uint8_t *data,
+                       size_t len) {
+    StaticJsonDocument<256> json;
+    if (deserializeJson(json, data, len)) {
+        Serial.println("Invalid WebSocket command");
+        return;
+    }
+    if (json.containsKey("ack")) {
+        queue_ws_request(WS_REQUEST_ACK, client->id(), json["ack"]);
+    }
+    const char *command = json["command"];
+    if (command == NULL) {
+        return;
+    }
+    if (strcmp(command, "resume") == 0) {
+        // Without this the loop never hears about the client, so better to
+        // have it reconnect and try again.
+        if (!queue_ws_request(WS_REQUEST_RESUME, client->id(),
+                              json["last_id"])) {
+            client->close();
+        }
+    } else if (strcmp(command, "start") == 0) {
+        request_start();
+    } else if (strcmp(command, "stop") == 0) {
+        request_stop();
+    } else if (strcmp(command, "calibrate") == 0) {
+        request_calibration();
+    } else if (strcmp(command, "parameters") == 0) {
+        // Same rules as handle_parameter, but always let the main loop send
+        // the event, since we're on the webserver's task here.
+        if (!telemetry_running) {
+            for (JsonPair parameter : json.as<JsonObject>()) {
+                if (strcmp(parameter.key().c_str(), "command") != 0) {
+                    set_parameter(parameter.key().c_str(),
+                                  parameter.value().as<String>());
+                }
+            }
+        }
+        send_parameters = true;
+        wake_loop();
     } else {
-        request->send(404);
+        Serial.print("Unknown WebSocket command: ");
+        Serial.println(command);
     }
 }
 
-void send_parameters_event() {
-    const int capacity = JSON_OBJECT_SIZE(6);
-    StaticJsonDocument<capacity> json;
-    json["empty_weight"] = empty_weight;
-    json["water_weight"] = water_weight;
-    json["air_pressure"] = air_pressure;
-    switch (accel_range) {
-        case MPU6050_RANGE_2_G:
-            json["accel_range"] = "2";
-            break;
-        case MPU6050_RANGE_4_G:
-            json["accel_range"] = "4";
-            break;
-        case MPU6050_RANGE_8_G:
-            json["accel_range"] = "8";
+void handle_ws_event(AsyncWebSocket *server, AsyncWebSocketClient *client,
+                     AwsEventType type, void *arg, uint8_t *data, size_t len) {
+    switch (type) {
+        case WS_EVT_DATA: {
+            AwsFrameInfo *info = (AwsFrameInfo *)arg;
+            // Commands are tiny, so anything fragmented isn't one of ours
+            if (info->final && info->index == 0 && info->len == len &&
+                info->opcode == WS_TEXT) {
+                handle_ws_command(client, data, len);
+            }
             break;
-        case MPU6050_RANGE_16_G:
-            json["accel_range"] = "16";
+        }
+        default:
+            // Clients only count once they've sent "resume", and
+            // disconnected ones get cleaned up in send_ws_event()
             break;
     }
-    switch (gyro_range) {
-        case MPU6050_RANGE_250_DEG:
-            json["gyro_range"] = "250";
-            break;
-        case MPU6050_RANGE_500_DEG:
-            json["gyro_range"] = "500";
-            break;
-        case MPU6050_RANGE_1000_DEG:
-            json["gyro_range"] = "1000";
-            break;
-        case MPU6050_RANGE_2000_DEG:
-            json["gyro_range"] = "2000";
-            break;
+}
+
+void handle_not_found(AsyncWebServerRequest *request) {
+    if (request->host() != portal_host) {
+        request->redirect(portal_url);
+    } else {
+        request->send(404);
     }
-    switch (filter_bandwidth) {
-        case MPU6050_BAND_260_HZ:
-            json["filter_bandwidth"] = "260";
-            break;
-        case MPU6050_BAND_184_HZ:
-            json["filter_bandwidth"] = "184";
-            break;
-        case MPU6050_BAND_94_HZ:
-            json["filter_bandwidth"] = "94";
-            break;
-        case MPU6050_BAND_44_HZ:
-            json["filter_bandwidth"] = "44";
-            break;
-        case MPU6050_BAND_21_HZ:
-            json["filter_bandwidth"] = "21";
-            break;
-        case MPU6050_BAND_10_HZ:
-            json["filter_bandwidth"] = "10";
-            break;
-        case MPU6050_BAND_5_HZ:
-            json["filter_bandwidth"] = "5";
+}
+
+// Token bucket per client IP. With only a handful of phones around, a small
+// table where the least recently seen client gets evicted is plenty.
+bool dns_rate_limited(uint32_t ip) {
+    uint32_t now = millis();
+    dns_rate_limit_t *slot = NULL;
+    dns_rate_limit_t *oldest = &dns_rate_limits[0];
+    for (int i = 0; i < DNS_RATE_LIMIT_CLIENTS; i++) {
+        if (dns_rate_limits[i].ip == ip) {
+            slot = &dns_rate_limits[i];
             break;
+        }
+        if (dns_rate_limits[i].last_ms < oldest->last_ms) {
+            oldest = &dns_rate_limits[i];
+        }
+    }
+    if (slot == NULL) {
+        slot = oldest;
+        slot->ip = ip;
+        slot->last_ms = now;
+        slot->tokens = DNS_BURST;
+    }
+    uint32_t refill = (now - slot->last_ms) * DNS_RATE_PER_SECOND / 1000;
+    if (refill > 0) {
+        uint32_t tokens = slot->tokens + refill;
+        slot->tokens = tokens > DNS_BURST ? DNS_BURST : tokens;
+        slot->last_ms = now;
+    }
+    if (slot->tokens == 0) {
+        return true;
+    }
+    slot->tokens--;
+    return false;
+}
+
+// Runs on the AsyncUDP task, so none of this holds up the main loop.
+void handle_dns_packet(AsyncUDPPacket &packet) {
+    const uint8_t *query = packet.data();
+    size_t len = packet.length();
+    if (len < 12 || len > DNS_MAX_PACKET - sizeof(dns_answer)) {
+        return;
     }
+    // Only standard queries, with a single question
+    if ((query[2] & 0xf8) != 0 || query[4] != 0 || query[5] != 1) {
+        return;
+    }
+    if (dns_rate_limited(packet.remoteIP())) {
+        return;
+    }
+    // Skip over the name, then the terminating zero, type and class
+    size_t pos = 12;
+    while (pos < len && query[pos] != 0) {
+        if (query[pos] & 0xc0) {
+            // Compression isn't allowed in a question
+            return;
+        }
+        pos += query[pos] + 1;
+    }
+    pos += 5;
+    if (pos > len) {
+        return;
+    }
+    uint16_t qtype = query[pos - 4] << 8 | query[pos - 3];
+    // Only A (and ANY) get an answer. Everything else, AAAA in particular,
+    // gets an empty response so the client doesn't sit waiting for it.
+    bool answer = qtype == 1 || qtype == 255;
+
+    uint8_t response[DNS_MAX_PACKET];
+    // Header and question, minus anything after the question, like EDNS
+    memcpy(response, query, pos);
+    response[2] = 0x80 | (query[2] & 0x01);  // response, keep RD
+    response[3] = 0x80;                      // RA, no error
+    response[6] = 0;
+    response[7] = answer ? 1 : 0;
+    memset(&response[8], 0, 4);
+    size_t response_len = pos;
+    if (answer) {
+        memcpy(&response[pos], dns_answer, sizeof(dns_answer));
+        response_len += sizeof(dns_answer);
+    }
+    packet.write(response, response_len);
+}
+
+void init_dns() {
+    IPAddress ip = WiFi.softAPIP();
+    uint8_t answer[] = {
+        0xc0, 0x0c,  // pointer to the name in the question
+        0, 1,        // type A
+        0, 1,        // class IN
+        (DNS_TTL >> 24) & 0xff, (DNS_TTL >> 16) & 0xff, (DNS_TTL >> 8) & 0xff,
+        DNS_TTL & 0xff,
+        0, 4,  // length of the address
+        ip[0], ip[1], ip[2], ip[3]};
+    static_assert(sizeof(answer) == sizeof(dns_answer), "DNS answer size");
+    memcpy(dns_answer, answer, sizeof(dns_answer));
+    memset(dns_rate_limits, 0, sizeof(dns_rate_limits));
+    if (!dns_udp.listen(DNS_PORT)) {
+        Serial.println("Failed to start DNS server");
+        return;
+    }
+    dns_udp.onPacket(handle_dns_packet);
+    Serial.println("DNS server started");
+}
+
+void add_sensor_options(JsonObject json, const char *name,
+                        sensor_options_t options) {
+    JsonArray values = json.createNestedArray(name);
+    for (const sensor_option_t &option : options) {
+        values.add(option.value);
+    }
+}
+
+void send_parameters_event() {
+    // The options are what the sensor backend supports, so the web interface
+    // can offer exactly those.
+    const int capacity = JSON_OBJECT_SIZE(7) + JSON_OBJECT_SIZE(3) +
+                         3 * JSON_ARRAY_SIZE(SENSOR_MAX_OPTIONS);
+    StaticJsonDocument<capacity> json;
+    // c_str() so they don't get copied into the document
+    json["empty_weight"] = empty_weight.c_str();
+    json["water_weight"] = water_weight.c_str();
+    json["air_pressure"] = air_pressure.c_str();
+    json["accel_range"] = accel_range;
+    json["gyro_range"] = gyro_range;
+    json["filter_bandwidth"] = filter_bandwidth;
+    JsonObject options = json.createNestedObject("options");
+    add_sensor_options(options, "accel_range", SensorBackend::accel_ranges());
+    add_sensor_options(options, "gyro_range", SensorBackend::gyro_ranges());
+    add_sensor_options(options, "filter_bandwidth",
+                       SensorBackend::filter_bandwidths());
     String json_string = "";
     serializeJson(json, json_string);
 
     send_event(json_string.c_str(), "parameters");
 }
 
-void handle_parameter(AsyncWebServerRequest *request) {
-    // If we're not idle, don't change parameters, just send the current ones.
-    // Because currently the web interface saves the parameters per run. But a
-    // client can join mid-run, and still needs to know the parameters.
-    if (telemetry_running) {
-        send_parameters_event();
+void send_stats_event(unsigned long time_to_first_sample_us) {
+    const int capacity = JSON_OBJECT_SIZE(5);
+    StaticJsonDocument<capacity> json;
+    json["time_to_first_sample_ms"] = time_to_first_sample_us / 1000;
+    json["idle_seconds"] = last_idle_ms / 1000;
+    json["idle_cpu_mhz"] = IDLE_CPU_MHZ;
+    json["idle_asleep_percent"] = last_idle_asleep_percent;
+    json["idle_battery_drop"] = last_idle_battery_drop;
+    String json_string = "";
+    serializeJson(json, json_string);
+    Serial.printf("Stats: %s\n", json_string.c_str());
+
+    send_event(json_string.c_str(), "stats");
+}
+
+String make_resync_json(const char *reason, uint32_t first_missing,
+                        uint32_t last_missing) {
+    const int capacity = JSON_OBJECT_SIZE(3);
+    StaticJsonDocument<capacity> json;
+    json["reason"] = reason;
+    if (first_missing) {
+        json["first_missing"] = first_missing;
+        json["last_missing"] = last_missing;
+    }
+    String json_string = "";
+    serializeJson(json, json_string);
+    return json_string;
+}
+
+void send_resync_event(AsyncEventSourceClient *client, const char *reason,
+                       uint32_t first_missing, uint32_t last_missing) {
+    String json_string =
+        make_resync_json(reason, first_missing, last_missing);
+    // No ID, so it doesn't change what the client reports as Last-Event-ID
+    client->send(json_string.c_str(), "resync");
+}
+
+void set_sensor_option(const String &name, sensor_options_t options,
+                       int value, int &requested) {
+    if (options.find(value) == NULL) {
+        Serial.print("Invalid ");
+        Serial.print(name);
+        Serial.print(": ");
+        Serial.println(value);
         return;
     }
+    requested = value;
+}
+
+// Sets a single parameter, for both HTTP and WebSocket clients. Returns true
+// if it was one that should be sent out to everyone immediately.
+bool set_parameter(const String &name, const String &value) {
     // The the weights & pressure are just informational, so we can set them
     // and send an event immediately.
-    bool send_event = false;
-    if (request->hasParam("empty_weight")) {
-        empty_weight.clear();
-        empty_weight.concat(request->getParam("empty_weight")->value());
+    if (name == "empty_weight") {
+        empty_weight = value;
         Serial.print("Empty weight set to ");
         Serial.println(empty_weight);
-        send_event = true;
+        return true;
     }
-    if (request->hasParam("water_weight")) {
-        water_weight.clear();
-        water_weight.concat(request->getParam("water_weight")->value());
+    if (name == "water_weight") {
+        water_weight = value;
         Serial.print("Water weight set to ");
         Serial.println(water_weight);
-        send_event = true;
+        return true;
     }
-    if (request->hasParam("air_pressure")) {
-        air_pressure.clear();
-        air_pressure.concat(request->getParam("air_pressure")->value());
+    if (name == "air_pressure") {
+        air_pressure = value;
         Serial.print("Air pressure set to ");
         Serial.println(air_pressure);
-        send_event = true;
+        return true;
     }
     // Don't try to set parameters in the sensors here, because the main loop
     // might be in the middle of some wire protocol stuff. Set the requested_
     // variable, and let the main loop handle it.
-    if (request->hasParam("accel_range")) {
-        int accel_range = request->getParam("accel_range")->value().toInt();
-        switch (accel_range) {
-            case 2:
-                requested_accel_range = MPU6050_RANGE_2_G;
-                break;
-            case 4:
-                requested_accel_range = MPU6050_RANGE_4_G;
-                break;
-            case 8:
-                requested_accel_range = MPU6050_RANGE_8_G;
-                break;
-            case 16:
-                requested_accel_range = MPU6050_RANGE_16_G;
-                break;
-            default:
-                Serial.print("Invalid accel_range: ");
-                Serial.println(accel_range);
-                break;
-        }
+    if (name == "accel_range") {
+        set_sensor_option(name, SensorBackend::accel_ranges(), value.toInt(),
+                          requested_accel_range);
     }
-    if (request->hasParam("gyro_range")) {
-        int gyro_range = request->getParam("gyro_range")->value().toInt();
-        switch (gyro_range) {
-            case 250:
-                requested_gyro_range = MPU6050_RANGE_250_DEG;
-                break;
-            case 500:
-                requested_gyro_range = MPU6050_RANGE_500_DEG;
-                break;
-            case 1000:
-                requested_gyro_range = MPU6050_RANGE_1000_DEG;
-                break;
-            case 2000:
-                requested_gyro_range = MPU6050_RANGE_2000_DEG;
-                break;
-            default:
-                Serial.print("Invalid gyro_range: ");
-                Serial.println(gyro_range);
-                break;
-        }
+    if (name == "gyro_range") {
+        set_sensor_option(name, SensorBackend::gyro_ranges(), value.toInt(),
+                          requested_gyro_range);
+    }
+    if (name == "filter_bandwidth") {
+        set_sensor_option(name, SensorBackend::filter_bandwidths(),
+                          value.toInt(), requested_filter_bandwidth);
     }
-    if (request->hasParam("filter_bandwidth")) {
-        int filter_bandwidth =
-            request->getParam("filter_bandwidth")->value().toInt();
-        switch (filter_bandwidth) {
-            case 260:
-                requested_filter_bandwidth = MPU6050_BAND_260_HZ;
-                break;
-            case 184:
-                requested_filter_bandwidth = MPU6050_BAND_184_HZ;
-                break;
-            case 94:
-                requested_filter_bandwidth = MPU6050_BAND_94_HZ;
-                break;
-            case 44:
-                requested_filter_bandwidth = MPU6050_BAND_44_HZ;
-                break;
-            case 21:
-                requested_filter_bandwidth = MPU6050_BAND_21_HZ;
-                break;
-            case 10:
-                requested_filter_bandwidth = MPU6050_BAND_10_HZ;
-                break;
-            case 5:
-                requested_filter_bandwidth = MPU6050_BAND_5_HZ;
-                break;
-            default:
-                Serial.print("Invalid filter_bandwidth: ");
-                Serial.println(filter_bandwidth);
-                break;
+    return false;
+}
+
+void handle_parameter(AsyncWebServerRequest *request) {
+    // If we're not idle, don't change parameters, just send the current ones.
+    // Because currently the web interface saves the parameters per run. But a
+    // client can join mid-run, and still needs to know the parameters.
+    if (telemetry_running) {
+        send_parameters_event();
+        return;
+    }
+    bool send_event = false;
+    int params = request->params();
+    for (int i = 0; i < params; i++) {
+        AsyncWebParameter *param = request->getParam(i);
+        if (set_parameter(param->name(), param->value())) {
+            send_event = true;
         }
     }
     if (send_event) {
         send_parameters_event();
     }
+    // The sensor settings get applied by the loop
+    wake_loop();
 }
 
 void init_sensors() {
-    if (!bmp.begin()) {
-        Serial.println("Could not find a valid BMP085 sensor, check wiring!");
+    if (!sensors.begin()) {
+        Serial.printf("Failed to initialize %s sensors\n",
+                      SensorBackend::name());
         while (1) {
             delay(1000);
         }
-    } else {
-        Serial.println("BMP085 sensor found");
-    }
-
-    if (!mpu.begin()) {
-        Serial.println("Failed to find MPU6050 chip");
-        while (1) {
-            delay(1000);
-        }
-    } else {
-        Serial.println("MPU6050 sensor found");
-    }
-    mpu.setAccelerometerRange(accel_range);
-    Serial.print("Accelerometer range set to: ");
-    switch (mpu.getAccelerometerRange()) {
-        case MPU6050_RANGE_2_G:
-            Serial.println("+-2G");
-            break;
-        case MPU6050_RANGE_4_G:
-            Serial.println("+-4G");
-            break;
-        case MPU6050_RANGE_8_G:
-            Serial.println("+-8G");
-            break;
-        case MPU6050_RANGE_16_G:
-            Serial.println("+-16G");
-            break;
     }
-    mpu.setGyroRange(gyro_range);
-    Serial.print("Gyro range set to: ");
-    switch (mpu.getGyroRange()) {
-        case MPU6050_RANGE_250_DEG:
-            Serial.println("+- 250 deg/s");
-            break;
-        case MPU6050_RANGE_500_DEG:
-            Serial.println("+- 500 deg/s");
-            break;
-        case MPU6050_RANGE_1000_DEG:
-            Serial.println("+- 1000 deg/s");
-            break;
-        case MPU6050_RANGE_2000_DEG:
-            Serial.println("+- 2000 deg/s");
-            break;
-    }
-
-    mpu.setFilterBandwidth(filter_bandwidth);
-    Serial.print("Filter bandwidth set to: ");
-    switch (mpu.getFilterBandwidth()) {
-        case MPU6050_BAND_260_HZ:
-            Serial.println("260 Hz");
-            break;
-        case MPU6050_BAND_184_HZ:
-            Serial.println("184 Hz");
-            break;
-        case MPU6050_BAND_94_HZ:
-            Serial.println("94 Hz");
-            break;
-        case MPU6050_BAND_44_HZ:
-            Serial.println("44 Hz");
-            break;
-        case MPU6050_BAND_21_HZ:
-            Serial.println("21 Hz");
-            break;
-        case MPU6050_BAND_10_HZ:
-            Serial.println("10 Hz");
-            break;
-        case MPU6050_BAND_5_HZ:
-            Serial.println("5 Hz");
-            break;
-    }
-}
\ No newline at end of file
+    sensors.set_accel_range(accel_range);
+    Serial.printf("Accelerometer range set to: +-%dG\n",
+                  sensors.accel_range());
+    sensors.set_gyro_range(gyro_range);
+    Serial.printf("Gyro range set to: +- %d deg/s\n", sensors.gyro_range());
+    sensors.set_filter_bandwidth(filter_bandwidth);
+    Serial.printf("Filter bandwidth set to: %d Hz\n",
+                  sensors.filter_bandwidth());
+}
@@ -0,0 +1,91 @@
+#!/usr/bin/env python
+"""
+    run2c
+    ~~~~~
+
+    Turns a run from a file saved with the Save... button in the web interface
+    into a C header for the replay sensor backend (sensors_replay.h).
+
+    Usage: python src/run2c.py telemetry.json [run_index] > src/replay_run.h
+"""
+
+import json
+import math
+import os
+import sys
+
+FIELDS = [
+    'acceleration_x', 'acceleration_y', 'acceleration_z',
+    'gyro_x', 'gyro_y', 'gyro_z',
+    'pressure', 'altitude',
+    'bmp_temperature', 'mpu_temperature',
+]
+
+STANDARD_PRESSURE = 101325.0
+
+
+def c_float(value):
+    # JSON.stringify() turns NaN into null
+    if value is None or math.isnan(value):
+        return 'NAN'
+    if math.isinf(value):
+        return 'INFINITY' if value > 0 else '-INFINITY'
+    return repr(float(value)) + 'f'
+
+
+def zero_pressure(data):
+    """ The pressure the run was calibrated with, worked back from the first
+    sample that has both a pressure and an altitude. Inverse of
+    pressure_to_altitude() in sensors.h.
+    """
+    for sample in data:
+        pressure = sample.get('pressure')
+        altitude = sample.get('altitude')
+        if pressure is None or altitude is None:
+            continue
+        if math.isnan(pressure) or math.isnan(altitude):
+            continue
+        return pressure / math.pow(1.0 - altitude / 44330, 1 / 0.1903)
+    return STANDARD_PRESSURE
+
+
+def run2c(filename, run_index=0):
+    """ Read a saved run and return it as a C header
+
+    :param filename: a file saved from the web interface.
+    :param run_index: which run in the file, starting at 0.
+    """
+    with open(filename) as in_file:
+        runs = json.load(in_file)
+    if run_index >= len(runs):
+        raise ValueError('%s has only %d runs' % (filename, len(runs)))
+    data = [sample for sample in runs[run_index]['data']
+            if sample.get('time') is not None]
+    if not data:
+        raise ValueError('run %d in %s has no samples' % (run_index, filename))
+    lines = [
+        '// Generated by run2c.py from %s, run %d. Don\'t edit.'
+        % (os.path.basename(filename), run_index),
+        '#pragma once',
+        '',
+        'const float replay_zero_pressure = %s;' % c_float(zero_pressure(data)),
+        '',
+        'const replay_sample_t replay_samples[] = {',
+    ]
+    for sample in data:
+        values = ', '.join(c_float(sample.get(field)) for field in FIELDS)
+        lines.append('    {%d, {%s}},' % (int(sample['time']), values))
+    lines.append('};')
+    return '\n'.join(lines) + '\n'
+
+
+def main():
+    if len(sys.argv) not in (2, 3):
+        print(__doc__)
+        sys.exit(1)
+    run_index = int(sys.argv[2]) if len(sys.argv) == 3 else 0
+    sys.stdout.write(run2c(sys.argv[1], run_index))
+
+
+if __name__ == '__main__':
+    main()
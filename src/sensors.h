@@ -0,0 +1,140 @@
+#pragma once
+// Sensor backends. Exactly one gets compiled in, picked by build flag, and
+// the rest of the firmware talks to it through the SensorBackend alias. There
+// are no virtual functions, so every call in the sample loop is a direct (and
+// usually inlined) call into the backend.
+//
+// A backend is a class that provides:
+//
+//   static const char *name();
+//   bool begin();
+//   void start_run();  // telemetry is starting, before the first read()
+//   void read(sensor_sample_t &sample, float zero_pressure);
+//   float read_pressure();
+//   float read_temperature();
+//   static sensor_options_t accel_ranges();       // +-G
+//   static sensor_options_t gyro_ranges();        // +-deg/s
+//   static sensor_options_t filter_bandwidths();  // Hz
+//   void set_accel_range(int value);
+//   void set_gyro_range(int value);
+//   void set_filter_bandwidth(int value);
+//   int accel_range();
+//   int gyro_range();
+//   int filter_bandwidth();
+//
+// Setters only ever get values that are in the matching options table. The
+// getters read back from the sensor, where possible.
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#else
+#include <chrono>
+#include <thread>
+#endif
+
+struct sensor_sample_t {
+    float acceleration_x;  // m/s^2
+    float acceleration_y;
+    float acceleration_z;
+    float gyro_x;  // rad/s
+    float gyro_y;
+    float gyro_z;
+    float pressure;         // Pa
+    float altitude;         // m, relative to zero_pressure
+    float bmp_temperature;  // C
+    float mpu_temperature;
+};
+
+// One supported setting of a sensor. `value` is what the web interface uses
+// (G, deg/s or Hz), `setting` is whatever the driver wants, usually an enum.
+struct sensor_option_t {
+    int value;
+    int setting;
+};
+
+// The most options any table has, so JSON capacity can be worked out at
+// compile time.
+#define SENSOR_MAX_OPTIONS 8
+
+struct sensor_options_t {
+    const sensor_option_t *options;
+    size_t count;
+
+    const sensor_option_t *begin() const { return options; }
+    const sensor_option_t *end() const { return options + count; }
+
+    const sensor_option_t *find(int value) const {
+        for (const sensor_option_t &option : *this) {
+            if (option.value == value) {
+                return &option;
+            }
+        }
+        return NULL;
+    }
+
+    const sensor_option_t *find_setting(int setting) const {
+        for (const sensor_option_t &option : *this) {
+            if (option.setting == setting) {
+                return &option;
+            }
+        }
+        return NULL;
+    }
+};
+
+// Turns a static constexpr array of sensor_option_t into a sensor_options_t
+template <size_t N>
+inline sensor_options_t make_sensor_options(
+    const sensor_option_t (&options)[N]) {
+    static_assert(N <= SENSOR_MAX_OPTIONS, "raise SENSOR_MAX_OPTIONS");
+    return {options, N};
+}
+
+// International barometric formula, same as the Adafruit drivers use. Doing
+// it ourselves saves reading the pressure sensor twice per sample.
+inline float pressure_to_altitude(float pressure, float zero_pressure) {
+    return 44330 * (1.0 - pow(pressure / zero_pressure, 0.1903));
+}
+
+// Clock for the backends that pace their own samples. On the board delay()
+// lets the other tasks run, so only the last bit is busy waiting.
+#ifdef ARDUINO
+inline uint32_t sensor_now_us() { return micros(); }
+
+inline void sensor_wait_until_us(uint32_t due_us) {
+    int32_t wait_us = due_us - micros();
+    if (wait_us <= 0) {
+        return;
+    }
+    delay(wait_us / 1000);
+    delayMicroseconds(wait_us % 1000);
+}
+#else
+inline uint32_t sensor_now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+inline void sensor_wait_until_us(uint32_t due_us) {
+    int32_t wait_us = due_us - sensor_now_us();
+    if (wait_us > 0) {
+        std::this_thread::sleep_for(std::chrono::microseconds(wait_us));
+    }
+}
+#endif
+
+#if defined(SENSOR_BACKEND_FAKE)
+#include "sensors_fake.h"
+typedef FakeSensors SensorBackend;
+#elif defined(SENSOR_BACKEND_REPLAY)
+#include "sensors_replay.h"
+typedef ReplaySensors SensorBackend;
+#else
+#include "sensors_mpu6050_bmp085.h"
+typedef Mpu6050Bmp085Sensors SensorBackend;
+#endif
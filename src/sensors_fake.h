@@ -0,0 +1,140 @@
+#pragma once
+// A backend without any hardware. Every read() advances simulated time by a
+// fixed step, and the flight repeats every FAKE_FLIGHT_CYCLE_MS, so the same
+// sequence of calls always gives the same samples. On the board read() also
+// waits until the step is due, like real sensors would, so the sample rate
+// and the flight keep up with the clock instead of running flat out. Useful
+// for running the firmware on a bare board, and for host-side tests of
+// everything downstream of the sensors, which don't wait. Doesn't need
+// Arduino. See sensors.h for the interface.
+
+#define FAKE_GRAVITY 9.80665f
+#define FAKE_ZERO_PRESSURE 101325.0f
+#define FAKE_FLIGHT_CYCLE_MS 10000
+#define FAKE_BURN_START_MS 1000
+#define FAKE_BURN_MS 300
+#define FAKE_BURN_ACCELERATION (8 * FAKE_GRAVITY)
+
+class FakeSensors {
+   public:
+    explicit FakeSensors(uint32_t step_ms = 10) : step_ms(step_ms) {}
+
+    static const char *name() { return "fake"; }
+
+    bool begin() {
+        time_ms = 0;
+        return true;
+    }
+
+    // The flight just keeps repeating, whenever a run starts
+    void start_run() {}
+
+    void read(sensor_sample_t &sample, float zero_pressure) {
+        wait_for_step();
+        float net_acceleration;
+        float altitude = flight_altitude(time_ms, net_acceleration);
+        // An accelerometer feels gravity too, except in free fall
+        float limit = accel_range_value * FAKE_GRAVITY;
+        float acceleration_z = net_acceleration + FAKE_GRAVITY;
+        if (acceleration_z > limit) {
+            acceleration_z = limit;
+        }
+        sample.acceleration_x = 0;
+        sample.acceleration_y = 0;
+        sample.acceleration_z = acceleration_z;
+        sample.gyro_x = 0;
+        sample.gyro_y = 0;
+        sample.gyro_z = 0;
+        sample.pressure = altitude_to_pressure(altitude);
+        sample.altitude = pressure_to_altitude(sample.pressure, zero_pressure);
+        sample.bmp_temperature = 25.0;
+        sample.mpu_temperature = 24.9;
+        time_ms += step_ms;
+    }
+
+    float read_pressure() {
+        float net_acceleration;
+        return altitude_to_pressure(flight_altitude(time_ms, net_acceleration));
+    }
+
+    float read_temperature() { return 25.0; }
+
+    // Same tables as the MPU6050, so the web interface looks the same
+    static sensor_options_t accel_ranges() {
+        static constexpr sensor_option_t options[] = {
+            {2, 2}, {4, 4}, {8, 8}, {16, 16}};
+        return make_sensor_options(options);
+    }
+
+    static sensor_options_t gyro_ranges() {
+        static constexpr sensor_option_t options[] = {
+            {250, 250}, {500, 500}, {1000, 1000}, {2000, 2000}};
+        return make_sensor_options(options);
+    }
+
+    static sensor_options_t filter_bandwidths() {
+        static constexpr sensor_option_t options[] = {
+            {260, 260}, {184, 184}, {94, 94}, {44, 44},
+            {21, 21},   {10, 10},   {5, 5}};
+        return make_sensor_options(options);
+    }
+
+    void set_accel_range(int value) { accel_range_value = value; }
+    void set_gyro_range(int value) { gyro_range_value = value; }
+    void set_filter_bandwidth(int value) { filter_bandwidth_value = value; }
+    int accel_range() { return accel_range_value; }
+    int gyro_range() { return gyro_range_value; }
+    int filter_bandwidth() { return filter_bandwidth_value; }
+
+   private:
+    uint32_t step_ms;
+    uint32_t time_ms = 0;
+    uint32_t next_read_us = 0;
+    int accel_range_value = 8;
+    int gyro_range_value = 500;
+    int filter_bandwidth_value = 21;
+
+    // If we fell behind, or nobody was reading (between runs), the next step
+    // is due a step from now. Catching up would just be a burst of samples.
+    void wait_for_step() {
+#ifdef ARDUINO
+        uint32_t now = sensor_now_us();
+        if ((int32_t)(next_read_us - now) > 0) {
+            sensor_wait_until_us(next_read_us);
+            now = next_read_us;
+        }
+        next_read_us = now + step_ms * 1000;
+#endif
+    }
+
+    static float altitude_to_pressure(float altitude) {
+        return FAKE_ZERO_PRESSURE * pow(1.0 - 2.25577e-5 * altitude, 5.25588);
+    }
+
+    // Sits on the pad, burns with constant acceleration, then falls
+    // ballistically until it hits the ground.
+    static float flight_altitude(uint32_t time_ms, float &net_acceleration) {
+        uint32_t t = time_ms % FAKE_FLIGHT_CYCLE_MS;
+        net_acceleration = 0;
+        if (t < FAKE_BURN_START_MS) {
+            return 0;
+        }
+        float burn = (t - FAKE_BURN_START_MS) / 1000.0;
+        if (t < FAKE_BURN_START_MS + FAKE_BURN_MS) {
+            net_acceleration = FAKE_BURN_ACCELERATION;
+            return 0.5 * FAKE_BURN_ACCELERATION * burn * burn;
+        }
+        float burn_time = FAKE_BURN_MS / 1000.0;
+        float burnout_altitude =
+            0.5 * FAKE_BURN_ACCELERATION * burn_time * burn_time;
+        float burnout_speed = FAKE_BURN_ACCELERATION * burn_time;
+        float coast = burn - burn_time;
+        float altitude = burnout_altitude + burnout_speed * coast -
+                         0.5 * FAKE_GRAVITY * coast * coast;
+        if (altitude <= 0) {
+            return 0;
+        }
+        net_acceleration = -FAKE_GRAVITY;
+        return altitude;
+    }
+};
@@ -0,0 +1,112 @@
+#pragma once
+// The GY-88A breakout: an MPU6050 for acceleration and rotation, and a BMP085
+// for pressure. See sensors.h for what a backend needs to provide.
+
+#include <Adafruit_BMP085.h>
+#include <Adafruit_MPU6050.h>
+#include <Arduino.h>
+
+class Mpu6050Bmp085Sensors {
+   public:
+    static const char *name() { return "MPU6050/BMP085"; }
+
+    bool begin() {
+        if (!bmp.begin()) {
+            Serial.println(
+                "Could not find a valid BMP085 sensor, check wiring!");
+            return false;
+        }
+        Serial.println("BMP085 sensor found");
+        if (!mpu.begin()) {
+            Serial.println("Failed to find MPU6050 chip");
+            return false;
+        }
+        Serial.println("MPU6050 sensor found");
+        return true;
+    }
+
+    void start_run() {}
+
+    void read(sensor_sample_t &sample, float zero_pressure) {
+        sensors_event_t a, g, temp;
+        mpu.getEvent(&a, &g, &temp);
+        sample.acceleration_x = a.acceleration.x;
+        sample.acceleration_y = a.acceleration.y;
+        sample.acceleration_z = a.acceleration.z;
+        sample.gyro_x = g.gyro.x;
+        sample.gyro_y = g.gyro.y;
+        sample.gyro_z = g.gyro.z;
+        sample.mpu_temperature = temp.temperature;
+        sample.pressure = bmp.readPressure();
+        sample.altitude = pressure_to_altitude(sample.pressure, zero_pressure);
+        sample.bmp_temperature = bmp.readTemperature();
+    }
+
+    float read_pressure() { return bmp.readPressure(); }
+
+    float read_temperature() { return bmp.readTemperature(); }
+
+    static sensor_options_t accel_ranges() {
+        static constexpr sensor_option_t options[] = {
+            {2, MPU6050_RANGE_2_G},
+            {4, MPU6050_RANGE_4_G},
+            {8, MPU6050_RANGE_8_G},
+            {16, MPU6050_RANGE_16_G},
+        };
+        return make_sensor_options(options);
+    }
+
+    static sensor_options_t gyro_ranges() {
+        static constexpr sensor_option_t options[] = {
+            {250, MPU6050_RANGE_250_DEG},
+            {500, MPU6050_RANGE_500_DEG},
+            {1000, MPU6050_RANGE_1000_DEG},
+            {2000, MPU6050_RANGE_2000_DEG},
+        };
+        return make_sensor_options(options);
+    }
+
+    static sensor_options_t filter_bandwidths() {
+        static constexpr sensor_option_t options[] = {
+            {260, MPU6050_BAND_260_HZ}, {184, MPU6050_BAND_184_HZ},
+            {94, MPU6050_BAND_94_HZ},   {44, MPU6050_BAND_44_HZ},
+            {21, MPU6050_BAND_21_HZ},   {10, MPU6050_BAND_10_HZ},
+            {5, MPU6050_BAND_5_HZ},
+        };
+        return make_sensor_options(options);
+    }
+
+    void set_accel_range(int value) {
+        mpu.setAccelerometerRange(
+            (mpu6050_accel_range_t)accel_ranges().find(value)->setting);
+    }
+
+    void set_gyro_range(int value) {
+        mpu.setGyroRange(
+            (mpu6050_gyro_range_t)gyro_ranges().find(value)->setting);
+    }
+
+    void set_filter_bandwidth(int value) {
+        mpu.setFilterBandwidth(
+            (mpu6050_bandwidth_t)filter_bandwidths().find(value)->setting);
+    }
+
+    int accel_range() {
+        return value_of(accel_ranges(), mpu.getAccelerometerRange());
+    }
+
+    int gyro_range() { return value_of(gyro_ranges(), mpu.getGyroRange()); }
+
+    int filter_bandwidth() {
+        return value_of(filter_bandwidths(), mpu.getFilterBandwidth());
+    }
+
+   private:
+    Adafruit_BMP085 bmp;
+    Adafruit_MPU6050 mpu;
+
+    static int value_of(sensor_options_t options, int setting) {
+        const sensor_option_t *option = options.find_setting(setting);
+        return option ? option->value : 0;
+    }
+};
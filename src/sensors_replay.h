@@ -0,0 +1,87 @@
+#pragma once
+// Replays a run saved from the web interface, so protocol and buffering
+// changes can be compared on exactly the same input. The run gets compiled in
+// as replay_run.h, see run2c.py. Every read() returns the next recorded
+// sample, once it's due: REPLAY_SPEED 1 keeps the original timing, 2 goes
+// twice as fast, and 0 doesn't wait at all. Every telemetry run starts the
+// replay from the top, and if the recording runs out first, it starts over.
+// Only needs Arduino for the clock. See sensors.h for the interface.
+
+// Borrowing its option tables
+#include "sensors_fake.h"
+
+#ifndef REPLAY_SPEED
+#define REPLAY_SPEED 1.0
+#endif
+
+struct replay_sample_t {
+    uint32_t time;  // ms, as recorded
+    sensor_sample_t sample;
+};
+
+#include "replay_run.h"
+
+#define REPLAY_SAMPLES (sizeof(replay_samples) / sizeof(replay_samples[0]))
+
+class ReplaySensors {
+   public:
+    static const char *name() { return "replay"; }
+
+    bool begin() {
+        start_run();
+        return true;
+    }
+
+    void start_run() {
+        index = 0;
+        start_us = sensor_now_us();
+    }
+
+    void read(sensor_sample_t &sample, float zero_pressure) {
+        if (index == REPLAY_SAMPLES) {
+            start_run();
+        }
+        const replay_sample_t &replay = replay_samples[index++];
+        if (REPLAY_SPEED > 0) {
+            // So -D REPLAY_SPEED=0 doesn't warn about dividing by zero here
+            const double speed = REPLAY_SPEED;
+            uint32_t offset_ms = replay.time - replay_samples[0].time;
+            sensor_wait_until_us(start_us +
+                                 (uint32_t)(offset_ms * 1000.0 / speed));
+        }
+        sample = replay.sample;
+        // Same as the recording if calibrated, see read_pressure()
+        sample.altitude = pressure_to_altitude(sample.pressure, zero_pressure);
+    }
+
+    // Calibrating gets the pressure the recording was calibrated with
+    float read_pressure() { return replay_zero_pressure; }
+
+    float read_temperature() {
+        return replay_samples[index % REPLAY_SAMPLES].sample.bmp_temperature;
+    }
+
+    // Whatever the recording was made with, the replay is the same. The
+    // settings are only kept so they read back the same as they were set.
+    static sensor_options_t accel_ranges() {
+        return FakeSensors::accel_ranges();
+    }
+    static sensor_options_t gyro_ranges() { return FakeSensors::gyro_ranges(); }
+    static sensor_options_t filter_bandwidths() {
+        return FakeSensors::filter_bandwidths();
+    }
+
+    void set_accel_range(int value) { accel_range_value = value; }
+    void set_gyro_range(int value) { gyro_range_value = value; }
+    void set_filter_bandwidth(int value) { filter_bandwidth_value = value; }
+    int accel_range() { return accel_range_value; }
+    int gyro_range() { return gyro_range_value; }
+    int filter_bandwidth() { return filter_bandwidth_value; }
+
+   private:
+    size_t index = 0;
+    uint32_t start_us = 0;
+    int accel_range_value = 8;
+    int gyro_range_value = 500;
+    int filter_bandwidth_value = 21;
+};